@@ -54,10 +54,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 /************Private include**********************************************/
 #include "kpage.h"
 #include "kma.h"
+#include "ktrace.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -69,26 +77,160 @@
 enum REQ_STATE
   {
     FREE,
-    USED
+    USED,
+    FAILED   /* kma_malloc returned NULL */
   };
 
 typedef struct mem
 {
   int size;
   void* ptr;
-  void* value; // to check correctness
+  unsigned long long seed; // to check correctness
   enum REQ_STATE state;
 } mem_t;
 
+/* buffers are filled with words seed, seed + PATTERNSTEP, ... so they
+ * can be checked without a copy; the seed differs for every allocation */
+#define PATTERNSTEP 0x9e3779b97f4a7c15ULL
+#define WORDSIZE sizeof(unsigned long long)
+
+/* what the replay records after every operation */
+typedef struct
+{
+  int allocBytes;
+  int pages;
+} sample_t;
+
+/* latency histograms, HDR style: HISTSUB linear sub-buckets per power
+ * of two keep every bucket within 1/HISTSUB of the values it holds */
+#define HISTSUBBITS 3
+#define HISTSUB (1 << HISTSUBBITS)
+#define HISTBUCKETS ((64 - HISTSUBBITS + 1) * HISTSUB)
+
+/* one histogram per operation and request size class: <=16 bytes,
+ * <=32 bytes, ..., <=MAXPAGESIZE bytes, larger */
+#define HISTMINSHIFT 4
+#define HISTCLASSES (MAXPAGESHIFT - HISTMINSHIFT + 2)
+
+enum HIST_OP
+  {
+    OP_MALLOC,
+    OP_FREE,
+    NUMOPS
+  };
+
+typedef struct
+{
+  unsigned long count;
+  unsigned long long max;
+  unsigned long buckets[HISTBUCKETS];
+} hist_t;
+
+/* a record of kma_output.dat, all ints in host byte order: the trace
+ * index, the bytes requested and the page bytes in use, and the bytes
+ * requested per size class */
+#define OUTPUTBUFFER 4096
+
+typedef struct
+{
+  int index;
+  int allocBytes;
+  int pageBytes;
+  int classBytes[HISTCLASSES];
+} output_t;
+
+/* how -t spreads a trace over the worker threads: request ids are
+ * sharded over the threads, or likewise with every free done by the
+ * thread after the one that allocated, or every thread replays all of
+ * it with buffers of its own */
+#define MAXTHREADS 64
+
+enum REPLAY_MODE
+  {
+    MODE_SHARD,
+    MODE_CROSS,
+    MODE_COPY
+  };
+
+typedef struct
+{
+  int index;
+  ktrace_t* trace;
+  mem_t* requests;
+  int ops;
+  double seconds;
+  hist_t (*hist)[HISTCLASSES];
+} worker_t;
+
+/* timestamps in TSC cycles where there is a TSC, nanoseconds elsewhere */
+#if defined(__x86_64__) || defined(__i386__)
+#define TIMEUNIT "cycles"
+#define NOW() __rdtsc()
+#else
+#define TIMEUNIT "ns"
+#define NOW() nanoseconds()
+#endif
+
 /************Global Variables*********************************************/
 
-static int val = 0;
+#ifndef COMPETITION
+/* allocations so far, part of the fill pattern seed */
+static __thread int val = 0;
+#endif
+
+/* the allocator picked with -DKMA_*, an index of kma_allocators[] */
+#if defined(KMA_RM)
+#define KMA_DEFAULT 1
+#elif defined(KMA_P2FL)
+#define KMA_DEFAULT 2
+#elif defined(KMA_MCK2)
+#define KMA_DEFAULT 3
+#elif defined(KMA_BUD)
+#define KMA_DEFAULT 4
+#elif defined(KMA_LZBUD)
+#define KMA_DEFAULT 5
+#else
+#define KMA_DEFAULT 0
+#endif
+
+static kma_alloc_t* gAlloc = &kma_allocators[KMA_DEFAULT];
+static int multiRun = FALSE;
+
+/* the driver samples memory use every gInterval operations */
+static int gInterval = 1;
+static int gClassBytes[HISTCLASSES];
+
+static int gThreads = 1;
+static int gMode = MODE_SHARD;
+static char* modeNames[] = { "shard", "cross", "copy" };
+
+/* serializes the allocators that are not thread-safe */
+static pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;
+static int gLockAlloc = FALSE;
+
+static pthread_barrier_t startBarrier;
+static worker_t workers[MAXTHREADS];
+
+/* per worker thread, the main thread's copy holds the totals */
+static __thread hist_t gHist[NUMOPS][HISTCLASSES];
 
 /************Function Prototypes******************************************/
+void replay(ktrace_t*, mem_t*);
+void analyze(ktrace_t*, sample_t*);
+double replayThreads(ktrace_t*, mem_t*);
+void reportThreads(mem_t*);
+void* worker(void*);
 void allocate();
 void deallocate();
-void fill(char*, int);
-void check(char*, char*, int);
+void fill(char*, int, unsigned long long);
+void check(char*, int, unsigned long long);
+void mismatch(int, unsigned long long, unsigned long long);
+int sizeClass(int);
+void record(int, int, unsigned long long);
+void merge(hist_t*, hist_t*);
+unsigned long long percentile(hist_t*, double);
+void report();
+unsigned long long nanoseconds();
 void usage();
 void error(char*, char*);
 void pass();
@@ -102,7 +244,7 @@ void fail();
 
 int anyMismatches = 0;
 
-int currentAllocBytes = 0;
+__thread int currentAllocBytes = 0;
 
 char *name = NULL;
 
@@ -120,124 +262,537 @@ main(int argc, char* argv[])
   printf("%s: Running in correctness mode\n", name);
 #endif
 
-  int n_req = 0, n_alloc=0, n_dealloc=0;
   kpage_stat_t* stat;
-
-#ifdef COMPETITION
-  double ratioSum = 0.0;
-  int ratioCount = 0;
-#endif
+  char* selection = NULL;
+  int opt, pagesize = PAGESIZE, maxpages = MAXPAGES;
   
-#ifndef COMPETITION
-  FILE* allocTrace = fopen("kma_output.dat", "w");
-  if (allocTrace == NULL)
+  while ((opt = getopt(argc, argv, "a:p:n:t:m:s:")) != -1)
     {
-      error("unable to open allocation output file", "kma_output.dat");
+      switch (opt)
+	{
+	case 'a':
+	  selection = optarg;
+	  break;
+	case 's':
+	  gInterval = atoi(optarg);
+	  if (gInterval < 1)
+	    {
+	      error("unsupported sampling interval", optarg);
+	    }
+	  break;
+	case 't':
+	  gThreads = atoi(optarg);
+	  if (gThreads < 1 || gThreads > MAXTHREADS)
+	    {
+	      error("unsupported number of threads", optarg);
+	    }
+	  break;
+	case 'm':
+	  gMode = MODE_SHARD;
+	  while (strcmp(optarg, modeNames[gMode]) != 0)
+	    {
+	      if (++gMode > MODE_COPY)
+		{
+		  error("unknown replay mode", optarg);
+		}
+	    }
+	  break;
+	case 'p':
+	  pagesize = atoi(optarg);
+	  break;
+	case 'n':
+	  maxpages = atoi(optarg);
+	  break;
+	default:
+	  usage();
+	}
     }
-  fprintf(allocTrace, "0 0 0\n");
-#endif
-
-  if (argc != 2)
+  
+  if (argc - optind != 1)
     {
       usage();
     }
   
-  FILE* f_test = fopen(argv[1], "r");
-  if (f_test == NULL)
+  if (!set_page_size(pagesize, maxpages))
+    {
+      char sizes[32];
+      snprintf(sizes, sizeof(sizes), "%d x %d", pagesize, maxpages);
+      error("unsupported page size x pages per chunk", sizes);
+    }
+  
+  // text traces are parsed up front so the replay does no parsing
+  ktrace_t* trace = ktrace_open(argv[optind]);
+  if (trace == NULL)
     {
-      error("unable to open input test file", argv[1]);
+      error("unable to read input test file", argv[optind]);
     }
   
-  // Get the number of requests in the trace file
-  // Allocate some memory...
-  int status = fscanf(f_test, "%d\n", &n_req);
-  if(status != 1)
-    error("Couldn't read number of requests at head of file", "");
+  mem_t* requests = malloc((trace->hdr->n_req + 1)*sizeof(mem_t));
+  assert(requests != NULL);
   
-  mem_t* requests = malloc((n_req + 1)*sizeof(mem_t));
-  memset(requests, 0, (n_req + 1)*sizeof(mem_t));
+  // Replay the trace once for every selected allocator,
+  // "all" runs every allocator back to back
+  kma_alloc_t* alloc;
+  char* next = selection;
+  multiRun = selection != NULL && (strcmp(selection, "all") == 0
+				   || strchr(selection, ',') != NULL);
+  
+  if (selection != NULL && strcmp(selection, "all") == 0)
+    {
+      for (alloc = kma_allocators; alloc->name != NULL; alloc++)
+	{
+	  kma_select(alloc->name);
+	  replay(trace, requests);
+	}
+    }
+  else
+    {
+      do
+	{
+	  if (next != NULL)
+	    {
+	      char* sep = strchr(next, ',');
+	      if (sep != NULL)
+		{
+		  *sep = '\0';
+		}
+	      if (kma_select(next) == NULL)
+		{
+		  error("unknown allocator", next);
+		}
+	      next = sep != NULL ? sep + 1 : NULL;
+	    }
+	  replay(trace, requests);
+	}
+      while (next != NULL);
+    }
+  
+  ktrace_close(trace);
+  free(requests);
+  
+  stat = page_stats();
   
-  char command[16];
-  int req_id, req_size, index = 1;
+  if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
+    {
+      error("not all pages freed", "");
+    }
+  
+  if(anyMismatches)
+    {
+      error("there were memory mismatches", "");
+    }
+
+  pass();
+  return 0;
+}
 
-  // Parse the lines in the file, and call allocate or
-  // deallocate accordingly.
-  while (fscanf(f_test, "%10s", command) == 1)
+void
+replay(ktrace_t* trace, mem_t* requests)
+{
+  int n_req = trace->hdr->n_req, n_ops = trace->hdr->n_ops;
+  kpage_stat_t* stat;
+  int requested, freed, i;
+  long long searched = 0;
+  double seconds;
+  
+  // Load: everything the replay touches is set up before the clock
+  // starts, the trace itself is already in memory
+  sample_t* samples = malloc((n_ops / gInterval + 1) * sizeof(sample_t));
+  assert(samples != NULL);
+  
+  memset(requests, 0, (n_req + 1)*sizeof(mem_t));
+  currentAllocBytes = 0;
+  memset(gHist, 0, sizeof(gHist));
+  memset(&gAlloc->stats, 0, sizeof(kma_stat_t));
+  gLockAlloc = gThreads > 1 && !gAlloc->threadsafe;
+  
+  // every allocator starts from an unbuilt pool, not from the chunks
+  // and free lists the one before it left
+  if (!reset_pages())
     {
-      if (strcmp(command, "REQUEST") == 0)
+      error("pages still in use before the replay", gAlloc->name);
+    }
+  
+  stat = page_stats();
+  requested = stat->num_requested;
+  freed = stat->num_freed;
+  if (gAlloc->searched != NULL)
+    {
+      searched = gAlloc->searched();
+    }
+  
+  if (gThreads > 1)
+    {
+      seconds = replayThreads(trace, requests);
+      n_ops = gAlloc->stats.num_malloc + gAlloc->stats.num_failed
+	+ gAlloc->stats.num_free;
+    }
+  else
+    {
+      // Replay: only the allocator calls and a two word sample every
+      // gInterval operations for the post-processing
+      ktrace_rec_t* rec = trace->recs;
+      sample_t* sample = samples;
+      int countdown = gInterval;
+      unsigned long long start = nanoseconds();
+      
+      for (i = 0; i < n_ops; i++, rec++)
 	{
+	  assert(rec->id < n_req);
 	  
-	  if (fscanf(f_test, "%d %d", &req_id, &req_size) != 2)
-	    error("Not enough arguments to REQUEST", "");
-
-	  assert(req_id >= 0 && req_id < n_req);
+	  if (rec->op == KTRACE_REQUEST)
+	    {
+	      allocate(requests, rec->id, rec->size);
+	    }
+	  else if (rec->op == KTRACE_FREE)
+	    {
+	      deallocate(requests, rec->id);
+	    }
+	  else
+	    {
+	      error("unknown command type in trace", "");
+	    }
 	  
-	  allocate(requests, req_id, req_size);
+	  if (--countdown == 0)
+	    {
+	      sample->allocBytes = currentAllocBytes;
+	      sample->pages = pages_in_use();
+	      sample++;
+	      countdown = gInterval;
+	    }
+	}
+      
+      seconds = (nanoseconds() - start) / 1e9;
+    }
+  
+  if (gAlloc->searched != NULL)
+    {
+      searched = gAlloc->searched() - searched;
+    }
+  
+  // leave nothing behind for the next allocator
+  gAlloc->reset();
+  
+  stat = page_stats();
+  
+  printf("Allocator: %s\n", gAlloc->name);
+  printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
+	 stat->num_requested - requested, stat->num_freed - freed,
+	 stat->num_in_use);	
+  printf("Page Pool Rebuilds/Chunks/Released: %5d/%5d/%5d\n",
+	 stat->num_rebuilds, stat->num_chunks, stat->num_released);
+  printf("Allocator Malloc/Free/Failed/Peak Bytes: %5d/%5d/%5d/%8d\n",
+	 gAlloc->stats.num_malloc, gAlloc->stats.num_free,
+	 gAlloc->stats.num_failed, gAlloc->stats.peak_bytes);
+  if (gAlloc->searched != NULL)
+    {
+      printf("Allocator Search Length: %.2f free buffers per malloc\n",
+	     (double) searched / (gAlloc->stats.num_malloc
+				  + gAlloc->stats.num_failed));
+    }
+  printf("Replay: %d ops in %.6f s, %.0f ops/sec\n",
+	 n_ops, seconds, n_ops / seconds);
+  if (gThreads > 1)
+    {
+      reportThreads(requests);
+    }
+  report();
+  
+  // Post-process: waste ratio and allocation output from the samples,
+  // which only make sense for a single thread
+  if (gThreads == 1)
+    {
+      analyze(trace, samples);
+    }
+  
+  free(samples);
+}
+
+void
+analyze(ktrace_t* trace, sample_t* samples)
+{
+  ktrace_rec_t* rec = trace->recs;
+  sample_t* sample = samples;
+  int n_alloc=0, n_dealloc=0, i;
+  double ratioSum = 0.0;
+  int ratioCount = 0;
+  
+  memset(gClassBytes, 0, sizeof(gClassBytes));
+  
+#ifndef COMPETITION
+  // one output file per allocator when several are replayed
+  char traceName[64] = "kma_output.dat";
+  if (multiRun)
+    {
+      snprintf(traceName, sizeof(traceName), "kma_output.%s.dat", gAlloc->name);
+    }
+  FILE* allocTrace = fopen(traceName, "wb");
+  if (allocTrace == NULL)
+    {
+      error("unable to open allocation output file", traceName);
+    }
+  
+  // records are collected in a buffer and written a buffer at a time
+  output_t* buffer = calloc(OUTPUTBUFFER, sizeof(output_t));
+  assert(buffer != NULL);
+  output_t* out = buffer + 1;
+#endif
+  
+  for (i = 0; i < trace->hdr->n_ops; i++, rec++)
+    {
+      if (rec->op == KTRACE_REQUEST)
+	{
 	  n_alloc++;
+	  gClassBytes[sizeClass(rec->size)] += rec->size;
 	}
-      else if (strcmp(command, "FREE") == 0)
+      else
 	{
-	  if (fscanf(f_test, "%d", &req_id) != 1)
-	    error("Not enough arguments to FREE", "");
-	  
-	  assert(req_id >= 0 && req_id < n_req);
-	  
-	  deallocate(requests, req_id);
 	  n_dealloc++;
+	  gClassBytes[sizeClass(rec->size)] -= rec->size;
 	}
-      else
+      
+      if ((i + 1) % gInterval != 0)
 	{
-	  error("unknown command type:", command);
+	  continue;
 	}
-
-      stat = page_stats();
-      int totalBytes = stat->num_in_use * stat->page_size;
-
       
-#ifdef COMPETITION
-      if(req_id < n_req && n_alloc != n_dealloc)
+      int totalBytes = sample->pages * PAGESIZE;
+      
+      if(n_alloc != n_dealloc)
 	{
 	  // We can calculate the ratio of wasted to used memory here.
 
-	  int wastedBytes = totalBytes - currentAllocBytes;
-	  ratioSum += ((double) wastedBytes) / currentAllocBytes;
+	  int wastedBytes = totalBytes - sample->allocBytes;
+	  ratioSum += ((double) wastedBytes) / sample->allocBytes;
 	  ratioCount += 1;
 	}
-#endif
 
 #ifndef COMPETITION
-      fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
+      out->index = i + 1;
+      out->allocBytes = sample->allocBytes;
+      out->pageBytes = totalBytes;
+      memcpy(out->classBytes, gClassBytes, sizeof(gClassBytes));
+      
+      if (++out == buffer + OUTPUTBUFFER)
+	{
+	  fwrite(buffer, sizeof(output_t), OUTPUTBUFFER, allocTrace);
+	  out = buffer;
+	}
 #endif
       
-      index += 1;
+      sample++;
     }
 
 #ifndef COMPETITION
-  fclose(allocTrace);
+  fwrite(buffer, sizeof(output_t), out - buffer, allocTrace);
+  if (fclose(allocTrace) != 0)
+    {
+      error("unable to write allocation output file", traceName);
+    }
+  free(buffer);
+#endif
+
+#ifdef COMPETITION
+  printf("Competition average ratio: %f\n", ratioSum / ratioCount);
 #endif
+}
+
+double
+replayThreads(ktrace_t* trace, mem_t* requests)
+{
+  pthread_t threads[MAXTHREADS];
+  int n_req = trace->hdr->n_req, i;
   
+  pthread_barrier_init(&startBarrier, NULL, gThreads + 1);
   
-  stat = page_stats();
+  for (i = 0; i < gThreads; i++)
+    {
+      workers[i].index = i;
+      workers[i].trace = trace;
+      workers[i].requests = requests;
+      workers[i].ops = 0;
+      workers[i].hist = malloc(sizeof(gHist));
+      assert(workers[i].hist != NULL);
+      
+      // copies replay the whole trace into buffers of their own
+      if (gMode == MODE_COPY && i > 0)
+	{
+	  workers[i].requests = calloc(n_req + 1, sizeof(mem_t));
+	  assert(workers[i].requests != NULL);
+	}
+      
+      if (pthread_create(&threads[i], NULL, worker, &workers[i]) != 0)
+	{
+	  error("unable to start worker thread", "");
+	}
+    }
   
-  printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
-	 stat->num_requested, stat->num_freed, stat->num_in_use);	
+  pthread_barrier_wait(&startBarrier);
+  unsigned long long start = nanoseconds();
   
-  if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
+  for (i = 0; i < gThreads; i++)
     {
-      error("not all pages freed", "");
+      pthread_join(threads[i], NULL);
     }
   
-  if(anyMismatches)
+  double seconds = (nanoseconds() - start) / 1e9;
+  pthread_barrier_destroy(&startBarrier);
+  
+  return seconds;
+}
+
+// prints throughput and latency of every worker, folds their
+// histograms into the totals report() prints and releases them
+void
+reportThreads(mem_t* requests)
+{
+  int i, op, class;
+  
+  printf("Threads: %d, mode %s\n", gThreads, modeNames[gMode]);
+  
+  for (i = 0; i < gThreads; i++)
     {
-      error("there were memory mismatches", "");
+      worker_t* w = &workers[i];
+      hist_t all[NUMOPS];
+      
+      // the thread's latency over all size classes, and the totals
+      // for report()
+      memset(all, 0, sizeof(all));
+      for (op = 0; op < NUMOPS; op++)
+	{
+	  for (class = 0; class < HISTCLASSES; class++)
+	    {
+	      merge(&all[op], &w->hist[op][class]);
+	      merge(&gHist[op][class], &w->hist[op][class]);
+	    }
+	}
+      
+      printf("  thread %2d: %8d ops %10.0f ops/sec, malloc p50/p99/max "
+	     "%llu/%llu/%llu, free p50/p99/max %llu/%llu/%llu %s\n",
+	     i, w->ops, w->ops / w->seconds,
+	     percentile(&all[OP_MALLOC], 0.50), percentile(&all[OP_MALLOC], 0.99),
+	     all[OP_MALLOC].max,
+	     percentile(&all[OP_FREE], 0.50), percentile(&all[OP_FREE], 0.99),
+	     all[OP_FREE].max, TIMEUNIT);
+      
+      free(w->hist);
+      if (w->requests != requests)
+	{
+	  free(w->requests);
+	}
     }
+}
 
-#ifdef COMPETITION
-  printf("Competition average ratio: %f\n", ratioSum / ratioCount);
-#endif
+void*
+worker(void* arg)
+{
+  worker_t* w = arg;
+  ktrace_rec_t* rec = w->trace->recs;
+  ktrace_rec_t* end = rec + w->trace->hdr->n_ops;
   
-  pass();
-  return 0;
+  memset(gHist, 0, sizeof(gHist));
+  
+  pthread_barrier_wait(&startBarrier);
+  unsigned long long start = nanoseconds();
+  
+  for (; rec < end; rec++)
+    {
+      int owner = rec->id % gThreads;
+      
+      if (gMode == MODE_CROSS && rec->op == KTRACE_FREE)
+	{
+	  owner = (owner + 1) % gThreads;
+	}
+      if (gMode != MODE_COPY && owner != w->index)
+	{
+	  continue;
+	}
+      
+      if (rec->op == KTRACE_REQUEST)
+	{
+	  allocate(w->requests, rec->id, rec->size);
+	}
+      else
+	{
+	  deallocate(w->requests, rec->id);
+	}
+      w->ops++;
+    }
+  
+  w->seconds = (nanoseconds() - start) / 1e9;
+  memcpy(w->hist, gHist, sizeof(gHist));
+  
+  return NULL;
+}
+
+void*
+kma_malloc(kma_size_t size)
+{
+  kma_stat_t* stats = &gAlloc->stats;
+  void* ptr;
+  
+  if (gLockAlloc)
+    {
+      pthread_mutex_lock(&allocLock);
+    }
+  ptr = gAlloc->malloc(size);
+  if (gLockAlloc)
+    {
+      pthread_mutex_unlock(&allocLock);
+    }
+  
+  if (ptr == NULL)
+    {
+      __atomic_add_fetch(&stats->num_failed, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+  
+  __atomic_add_fetch(&stats->num_malloc, 1, __ATOMIC_RELAXED);
+  int bytes = __atomic_add_fetch(&stats->num_bytes, size, __ATOMIC_RELAXED);
+  int peak = __atomic_load_n(&stats->peak_bytes, __ATOMIC_RELAXED);
+  while (bytes > peak
+	 && !__atomic_compare_exchange_n(&stats->peak_bytes, &peak, bytes, TRUE,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+  
+  return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  kma_stat_t* stats = &gAlloc->stats;
+  
+  if (gLockAlloc)
+    {
+      pthread_mutex_lock(&allocLock);
+    }
+  gAlloc->free(ptr, size);
+  if (gLockAlloc)
+    {
+      pthread_mutex_unlock(&allocLock);
+    }
+  
+  __atomic_add_fetch(&stats->num_free, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&stats->num_bytes, size, __ATOMIC_RELAXED);
+}
+
+kma_alloc_t*
+kma_select(char* name)
+{
+  kma_alloc_t* alloc;
+  
+  for (alloc = kma_allocators; alloc->name != NULL; alloc++)
+    {
+      if (strcmp(alloc->name, name) == 0)
+	{
+	  gAlloc = alloc;
+	  return alloc;
+	}
+    }
+  
+  return NULL;
 }
 
 void
@@ -256,7 +811,10 @@ pass()
 
 void
 usage() {
-  printf("Usage: %s traceFile\n", name);
+  printf("Usage: %s [-a allocator[,allocator...] | -a all] [-p pageSize] "
+	 "[-n pagesPerChunk] [-s sampleInterval] [-t threads [-m shard|cross|copy]] "
+	 "traceFile\n",
+	 name);
   exit(0);
 }
 
@@ -271,43 +829,47 @@ allocate(mem_t* requests, int req_id, int req_size)
 {
   mem_t* new = &requests[req_id];
   
+  // with cross-thread frees the previous use of the id, whether it got
+  // a buffer or not, may still wait for its free on another thread
+  while (gMode == MODE_CROSS
+	 && __atomic_load_n(&new->state, __ATOMIC_ACQUIRE) != FREE)
+    {
+      sched_yield();
+    }
   assert(new->state == FREE);
   
   new->size = req_size;
+  
+  unsigned long long start = NOW();
   new->ptr = kma_malloc(new->size);
+  record(OP_MALLOC, req_size, NOW() - start);
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+  // Accept a NULL response for requests that do not fit in a page,
+  // larger requests may be served from continuous pages
+  if((new->ptr == NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
     {
       error("got NULL from kma_malloc for alloc'able request", "");
     }
   
   if (new->ptr == NULL)
     {
+      __atomic_store_n(&new->state, FAILED, __ATOMIC_RELEASE);
       return;
     }
 
   currentAllocBytes += req_size;
   
 #ifndef COMPETITION
-  // Only run the actual memory accesses/copies/checks if we're
+  // Only run the actual memory accesses/checks if we're
   // testing for correctness.
   
-  new->value = malloc(new->size);
-  assert(new->value != NULL);
-  
   // initialize memory
-  fill((char*)new->ptr, new->size);
-  
-  // copy the value for further reference
-  bcopy(new->ptr, new->value, new->size);
-  
-  check((char*)new->ptr, (char*)new->value, new->size);
+  new->seed = ((unsigned long long) req_id << 32) | (unsigned int) val++;
+  fill((char*)new->ptr, new->size, new->seed);
   
 #endif
 
-  new->state = USED;
+  __atomic_store_n(&new->state, USED, __ATOMIC_RELEASE);
 }
 
 void
@@ -315,6 +877,19 @@ deallocate(mem_t* requests, int req_id)
 {
   mem_t* cur = &requests[req_id];
   
+  // with cross-thread frees the buffer may not be allocated yet; once
+  // it is, the state is USED, or FAILED if there is no buffer
+  while (gMode == MODE_CROSS
+	 && __atomic_load_n(&cur->state, __ATOMIC_ACQUIRE) == FREE)
+    {
+      sched_yield();
+    }
+  // a request kma_malloc turned down has no buffer to free
+  if (cur->state == FAILED)
+    {
+      __atomic_store_n(&cur->state, FREE, __ATOMIC_RELEASE);
+      return;
+    }
   assert(cur->state == USED);
   assert(cur->size > 0);
   
@@ -322,42 +897,216 @@ deallocate(mem_t* requests, int req_id)
   // Only run the memory checks if we're testing for correctness.
 
   // check memory
-  check((char*)cur->ptr, (char*)cur->value, cur->size);
-
-  // free memory
-  free(cur->value);
+  check((char*)cur->ptr, cur->size, cur->seed);
 #endif
 
+  unsigned long long start = NOW();
   kma_free(cur->ptr, cur->size);
+  record(OP_FREE, cur->size, NOW() - start);
 
   currentAllocBytes -= cur->size;
   
-  cur->state = FREE;
+  __atomic_store_n(&cur->state, FREE, __ATOMIC_RELEASE);
 }
 
 void
-fill(char* ptr, int size)
+fill(char* ptr, int size, unsigned long long seed)
 {
+  unsigned long long word = seed;
   int i;
   
-  for (i = 0; i < size; i++)
+  // buffers need not be word aligned, memcpy makes unaligned stores
+  for (i = 0; i + WORDSIZE <= size; i += WORDSIZE, word += PATTERNSTEP)
+    {
+      memcpy(ptr + i, &word, WORDSIZE);
+    }
+  memcpy(ptr + i, &word, size - i);
+}
+
+void
+check(char* ptr, int size, unsigned long long seed)
+{
+  unsigned long long word = seed, found;
+  int i;
+  
+  for (i = 0; i + WORDSIZE <= size; i += WORDSIZE, word += PATTERNSTEP)
+    {
+      memcpy(&found, ptr + i, WORDSIZE);
+      if (found != word)
+	{
+	  mismatch(i, found, word);
+	}
+    }
+  
+  // the bytes past the end keep the expected value
+  found = word;
+  memcpy(&found, ptr + i, size - i);
+  if (found != word)
     {
-      ptr[i] = (char) val++;
+      mismatch(i, found, word);
     }
 }
 
 void
-check(char* lhs, char* rhs, int size)
+mismatch(int position, unsigned long long found, unsigned long long word)
 {
+  char* lhs = (char*) &found;
+  char* rhs = (char*) &word;
   int i;
   
-  for (i = 0; i < size; i++)
+  for (i = 0; i < WORDSIZE; i++)
     {
       if (lhs[i] != rhs[i])
 	{
 	  fprintf(stderr, "memory mismatch at position %d (%3d!=%3d)\n", 
-		  i, lhs[i], rhs[i]);
+		  position + i, lhs[i], rhs[i]);
 	  anyMismatches = 1;
 	}
     }
 }
+
+int
+sizeClass(int size)
+{
+  int class = 0;
+  
+  while (class < HISTCLASSES - 1 && size > (1 << (class + HISTMINSHIFT)))
+    {
+      class++;
+    }
+  
+  return class;
+}
+
+void
+record(int op, int size, unsigned long long latency)
+{
+  int class = sizeClass(size), bucket = latency;
+  
+  // values below HISTSUB get a bucket each, above that the exponent
+  // picks the row and the next HISTSUBBITS bits the sub-bucket
+  if (latency >= HISTSUB)
+    {
+      int exp = 63 - __builtin_clzll(latency);
+      bucket = (exp - HISTSUBBITS + 1) * HISTSUB
+	+ ((latency >> (exp - HISTSUBBITS)) & (HISTSUB - 1));
+    }
+  
+  hist_t* hist = &gHist[op][class];
+  hist->count++;
+  hist->buckets[bucket]++;
+  if (latency > hist->max)
+    {
+      hist->max = latency;
+    }
+}
+
+void
+merge(hist_t* into, hist_t* hist)
+{
+  int bucket;
+  
+  into->count += hist->count;
+  if (hist->max > into->max)
+    {
+      into->max = hist->max;
+    }
+  for (bucket = 0; bucket < HISTBUCKETS; bucket++)
+    {
+      into->buckets[bucket] += hist->buckets[bucket];
+    }
+}
+
+unsigned long long
+percentile(hist_t* hist, double fraction)
+{
+  unsigned long rank = (unsigned long) (fraction * hist->count + 0.5);
+  unsigned long seen = 0;
+  int bucket;
+  
+  for (bucket = 0; bucket < HISTBUCKETS; bucket++)
+    {
+      seen += hist->buckets[bucket];
+      if (seen >= rank && seen > 0)
+	{
+	  break;
+	}
+    }
+  
+  if (bucket < HISTSUB)
+    {
+      return bucket;
+    }
+  
+  // report the highest value the bucket holds, capped by the max seen
+  int exp = bucket / HISTSUB + HISTSUBBITS - 1;
+  unsigned long long low = (unsigned long long) (HISTSUB + bucket % HISTSUB)
+    << (exp - HISTSUBBITS);
+  unsigned long long high = low + (1ULL << (exp - HISTSUBBITS)) - 1;
+  
+  return high < hist->max ? high : hist->max;
+}
+
+void
+report()
+{
+  static const char* opNames[NUMOPS] = { "malloc", "free" };
+  int op, class;
+  
+  printf("%-17s %10s %9s %9s %9s %9s\n", "Latency (" TIMEUNIT ")",
+	 "count", "p50", "p99", "p99.9", "max");
+  
+  for (op = 0; op < NUMOPS; op++)
+    {
+      hist_t all;
+      memset(&all, 0, sizeof(all));
+      
+      for (class = 0; class <= HISTCLASSES; class++)
+	{
+	  hist_t* hist = &all;
+	  char label[16];
+	  
+	  if (class < HISTCLASSES)
+	    {
+	      hist = &gHist[op][class];
+	      if (hist->count == 0)
+		{
+		  continue;
+		}
+	      
+	      merge(&all, hist);
+	      
+	      if (class < HISTCLASSES - 1)
+		{
+		  snprintf(label, sizeof(label), "<=%d", 1 << (class + HISTMINSHIFT));
+		}
+	      else
+		{
+		  snprintf(label, sizeof(label), ">%d", MAXPAGESIZE);
+		}
+	    }
+	  else if (all.count == 0)
+	    {
+	      continue;
+	    }
+	  else
+	    {
+	      snprintf(label, sizeof(label), "all");
+	    }
+	  
+	  printf("  %-6s %-8s %10lu %9llu %9llu %9llu %9llu\n",
+		 opNames[op], label, hist->count,
+		 percentile(hist, 0.50), percentile(hist, 0.99),
+		 percentile(hist, 0.999), hist->max);
+	}
+    }
+}
+
+unsigned long long
+nanoseconds()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
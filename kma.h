@@ -69,6 +69,28 @@
 
 typedef int kma_size_t;
 
+/* counters kept by kma_malloc() and kma_free() for every allocator */
+typedef struct
+{
+  int num_malloc;
+  int num_free;
+  int num_failed;   /* requests answered with NULL */
+  int num_bytes;    /* requested bytes in use */
+  int peak_bytes;
+} kma_stat_t;
+
+/* an allocator in the allocator table */
+typedef struct
+{
+  char* name;
+  void* (*malloc)(kma_size_t);
+  void (*free)(void*, kma_size_t);
+  void (*reset)();
+  int threadsafe;   /* FALSE if calls must be serialized */
+  long long (*searched)();   /* free buffers looked at so far, or NULL */
+  kma_stat_t stats;
+} kma_alloc_t;
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/
@@ -95,6 +117,43 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+/***********************************************************************
+ *  Title: Selects the kernel memory allocator
+ * ---------------------------------------------------------------------
+ *    Purpose: Routes kma_malloc() and kma_free() to an allocator of
+ *             the allocator table; the allocator chosen with -DKMA_*
+ *             at build time is selected from the start
+ *    Input: the name of the allocator
+ *    Output: the allocator or NULL if there is no such allocator
+ ***********************************************************************/
+EXTERN kma_alloc_t* kma_select(char* name);
+
+/* the allocator table, terminated by an entry without a name */
+extern kma_alloc_t kma_allocators[];
+
+/* entry points of the allocators; the reset functions drop the state
+ * an allocator keeps once all its buffers are freed, so the next run
+ * starts from scratch */
+void* dummy_malloc(kma_size_t);
+void dummy_free(void*, kma_size_t);
+void dummy_reset();
+void* rm_malloc(kma_size_t);
+void rm_free(void*, kma_size_t);
+void rm_reset();
+long long rm_searched();
+void* p2fl_malloc(kma_size_t);
+void p2fl_free(void*, kma_size_t);
+void p2fl_reset();
+void* mck2_malloc(kma_size_t);
+void mck2_free(void*, kma_size_t);
+void mck2_reset();
+void* bud_malloc(kma_size_t);
+void bud_free(void*, kma_size_t);
+void bud_reset();
+void* lzbud_malloc(kma_size_t);
+void lzbud_free(void*, kma_size_t);
+void lzbud_reset();
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
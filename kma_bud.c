@@ -35,7 +35,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_BUD
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -58,13 +57,13 @@
 
 /* buffer size, number of buffer types, and page header sizes */
 #define MINBUFSIZE 32
-#define MAXBUFCLASS 8
-#define FIRSTPAGEHEADERSIZE (sizeof(pageHeader_t) + sizeof(buddyFreeLists_t))
-#define PAGEHEADERSIZE (sizeof(pageHeader_t))
+#define MAXBUFCLASS (MAXPAGESHIFT - 5) /* MAXPAGESIZE / 2 down to MINBUFSIZE */
+#define FIRSTPAGEHEADERSIZE (PAGEHEADERSIZE + sizeof(buddyFreeLists_t))
+#define PAGEHEADERSIZE (sizeof(pageHeader_t) + BITMAPSEGS)
 
-/* number of bits per char, and maximal number of bitmap segments */
+/* number of bits per char, and number of bitmap segments of a page */
 #define BITSPERCHAR 8
-#define MAXBITMAPSEGS ((PAGESIZE / MINBUFSIZE) / BITSPERCHAR)
+#define BITMAPSEGS ((PAGESIZE / MINBUFSIZE) / BITSPERCHAR)
 
 /* bitmap annotation */
 #define FREE 0
@@ -85,16 +84,11 @@ typedef struct {
   bufferHeader_t* ptr;
 } freeListHeader_t;
 
-/* bitmap */
-typedef struct {
-  unsigned char bitSegments[MAXBITMAPSEGS];
-} bitMap_t;
-
-/* page header */
+/* page header, followed by the bitmap of the page */
 typedef struct {
   kpage_t* page;
-  bitMap_t bitMap;
   int spaceUsed;
+  unsigned char bitMap[];
 } pageHeader_t;
 
 /* central structure for all free lists,
@@ -110,31 +104,31 @@ typedef struct {
 static buddyFreeLists_t* budfls;;
 
 /************Function Prototypes******************************************/
-bool
-init(kma_size_t size);
-void
+static void
+init();
+static void
 header_alloc(void* pagePtr, kma_size_t headerSize);
-void*
+static void*
 big_size_alloc(kma_size_t reqSize);
-void*
+static void*
 buddy_alloc(kma_size_t reqSize);
-freeListHeader_t*
+static freeListHeader_t*
 coalesce(void* pagePtr, void* bufPtr, kma_size_t bufSize);
-int
+static int
 get_buf_class(kma_size_t bufSize);
-void
+static void
 get_buffer_from_large_buffer(void* pagePtr, kma_size_t reqBufSize,
 			     kma_size_t largeBufSize, kma_size_t largeBufStartAddr);
-void
+static void
 add_buffer_to_free_list(void* pagePtr, int bufClass,
 			kma_size_t startAddr, kma_size_t bufSize);
-void
+static void
 remove_buffer_from_free_list(bufferHeader_t* bufHdrPtr, int bufClass);
-void
+static void
 update_bitmap(void* pagePtr, void* bufPtr, kma_size_t bufSize, bool status);
-int
+static int
 lookup_bitmap(void* pagePtr, kma_size_t bufStartAddr);
-kma_size_t
+static kma_size_t
 get_roundup(kma_size_t reqSize);
 	
 /************External Declaration*****************************************/
@@ -142,23 +136,14 @@ get_roundup(kma_size_t reqSize);
 /**************Implementation***********************************************/
 
 void*
-kma_malloc(kma_size_t size)
+bud_malloc(kma_size_t size)
 {
-  /* cannot allocate more than 1 page */
-  if (size > PAGESIZE) {
-    error("requested size is larger than PAGESIZE.", "");
-    return NULL;
-  }
-
   /* initialize the central data structure */
   if (budfls == NULL) {
-    /* if size is too large for keeping a page header, return */
-    if (!init(size)) {
-      return NULL;
-    }
+    init();
   }
 
-  if (PAGESIZE / 2 < size) { // the requested size needs a new page
+  if (PAGESIZE / 2 < size) { // the requested size needs new pages
     return big_size_alloc(size);
   } else { // the requested size might fit in a free buffer
     return buddy_alloc(size);
@@ -168,21 +153,21 @@ kma_malloc(kma_size_t size)
 }
 
 void 
-kma_free(void* ptr, kma_size_t size)
+bud_free(void* ptr, kma_size_t size)
 {
   void* pagePtr = ptr - ((long)ptr % PAGESIZE);
 
-  /* buffer occupies one page; free the page */
+  /* buffer occupies whole pages; free the pages */
   if (size > PAGESIZE / 2) {
     kpage_t* page;
-    page = *((kpage_t**)(pagePtr));
+    page = lookup_page(pagePtr);
     budfls->pagesUsed--;
 
     void* firstPagePtr = budfls->firstPagePtr;
     kma_size_t firstPageSpaceUsed = ((pageHeader_t*)(budfls->firstPagePtr))->spaceUsed;
     short pagesUsed = budfls->pagesUsed;
 
-    free_page(page);
+    free_pages(page);
     /* if the freed page is the second last page, 
      * and the last page (with the central information) is empty,
      * free the last page also.
@@ -190,7 +175,6 @@ kma_free(void* ptr, kma_size_t size)
     if (pagePtr != firstPagePtr) {
       if (firstPageSpaceUsed == 0 &&
 	  pagesUsed == 1) {
-	printf("freeing first page %lx\n", (unsigned long)firstPagePtr);
 	free_page(((pageHeader_t*)firstPagePtr)->page);
 	budfls = NULL;
       }
@@ -260,55 +244,49 @@ kma_free(void* ptr, kma_size_t size)
 
 }
 
-bool
-init(kma_size_t size)
+static void
+init()
 {
   kpage_t* page = get_page();
   *((kpage_t**)page->ptr) = page;
 
-  if (page->size < size + PAGEHEADERSIZE) { // the requested size cannot fit in any page
-    free_page(page);
-    error("init: page size too small for requested size.", "");
-    return FALSE;
-  }
-
   /* initialize central information */
   budfls = page->ptr + PAGEHEADERSIZE;
   budfls->pagesUsed = 1;
   budfls->firstPagePtr = page->ptr;
   int i, bufSize = PAGESIZE / 2;
-  for (i = 0; i < MAXBUFCLASS; i++) {
+  for (i = 0; bufSize >= MINBUFSIZE; i++) {
     (budfls->fl[i]).size = bufSize;
     (budfls->fl[i]).ptr = NULL;
     bufSize /= 2;
   }
 
   header_alloc(page->ptr, FIRSTPAGEHEADERSIZE);
-
-  return TRUE;
 }
 
-void
+static void
 header_alloc(void* pagePtr, kma_size_t headerSize)
 {
   /* make room for the page header */
   get_buffer_from_large_buffer(pagePtr, headerSize, PAGESIZE, 0);
   /* update bitmap to all 0 */
-  memset(pagePtr + sizeof(kpage_t*), '\000', MAXBITMAPSEGS);
+  memset(((pageHeader_t*)pagePtr)->bitMap, '\000', BITMAPSEGS);
   ((pageHeader_t*)pagePtr)->spaceUsed = 0;
 }
 
-void*
+static void*
 big_size_alloc(kma_size_t reqSize)
 {
-  kpage_t* page = get_page();
-  *((kpage_t**)page->ptr) = page;
+  /* for buffer larger than half page, allocate whole new pages */
+  kpage_t* page = get_pages((reqSize + PAGESIZE - 1) / PAGESIZE);
+  if (page == NULL) {
+    return NULL;
+  }
   budfls->pagesUsed++;
-  /* for buffer larger than half page, allocate a whole new page*/
-  return page->ptr + sizeof(kpage_t*) + sizeof(bitMap_t);
+  return page->ptr;
 }
 
-void*
+static void*
 buddy_alloc(kma_size_t reqSize)
 {
   kma_size_t reqBufSize = get_roundup(reqSize);
@@ -316,7 +294,7 @@ buddy_alloc(kma_size_t reqSize)
   int bufClass = reqBufClass;
   void* bufPtr;
   /* find available buffer on free lists */
-  while ((budfls->fl[bufClass]).ptr == NULL && bufClass >= 0) {
+  while (bufClass >= 0 && (budfls->fl[bufClass]).ptr == NULL) {
     bufClass--;
   }
   /* buffer found */
@@ -345,7 +323,7 @@ buddy_alloc(kma_size_t reqSize)
   return bufPtr;
 }
 
-freeListHeader_t*
+static freeListHeader_t*
 coalesce(void* pagePtr, void* bufPtr, kma_size_t bufSize)
 {
   int bufClass = get_buf_class(bufSize);
@@ -371,13 +349,13 @@ coalesce(void* pagePtr, void* bufPtr, kma_size_t bufSize)
   }
 }
 
-int
+static int
 get_buf_class(kma_size_t bufSize)
 {
   return (int)log2(PAGESIZE / bufSize) - 1;
 }
 
-void
+static void
 get_buffer_from_large_buffer(void* pagePtr, kma_size_t reqBufSize,
 			     kma_size_t largeBufSize, kma_size_t largeBufStartAddr)
 {
@@ -396,7 +374,7 @@ get_buffer_from_large_buffer(void* pagePtr, kma_size_t reqBufSize,
   }
 }
 
-void
+static void
 add_buffer_to_free_list(void* pagePtr, int bufClass,
 			kma_size_t bufStartAddr, kma_size_t bufSize)
 {
@@ -412,7 +390,7 @@ add_buffer_to_free_list(void* pagePtr, int bufClass,
   (budfls->fl[bufClass]).ptr = bufHdrPtr;
 }
 
-void
+static void
 remove_buffer_from_free_list(bufferHeader_t* bufHdrPtr, int bufClass)
 {
   // get a buffer from a free list
@@ -429,15 +407,15 @@ remove_buffer_from_free_list(bufferHeader_t* bufHdrPtr, int bufClass)
   }
 }
 
-void
+static void
 update_bitmap(void* pagePtr, void* bufPtr, kma_size_t bufSize, bool status)
 {
   int totalBits = bufSize / MINBUFSIZE;
   int i;
   unsigned char mask = 0xff;
-  bitMap_t* bitMapLoc = pagePtr + sizeof(kpage_t*);
+  unsigned char* bitMapLoc = ((pageHeader_t*)pagePtr)->bitMap;
   kma_size_t bufStartAddr = (long)bufPtr - (long)pagePtr;
-  /* the 256 bits bitmap is stored in 8 unsigned chars;
+  /* the bitmap holds one bit per MINBUFSIZE bytes of the page;
    * segNo is the index of a char;
    * bitNo is the index of a bit in the char.
    */
@@ -449,9 +427,9 @@ update_bitmap(void* pagePtr, void* bufPtr, kma_size_t bufSize, bool status)
       mask -= 1 << i;
     }
     if (status == FREE) {
-      bitMapLoc->bitSegments[segNo] &= mask;
+      bitMapLoc[segNo] &= mask;
     } else {
-      bitMapLoc->bitSegments[segNo] |= ~mask;
+      bitMapLoc[segNo] |= ~mask;
     }
     return;
   }
@@ -463,17 +441,17 @@ update_bitmap(void* pagePtr, void* bufPtr, kma_size_t bufSize, bool status)
   }
 }
 
-int
+static int
 lookup_bitmap(void* pagePtr, kma_size_t bufStartAddr)
 {
-  bitMap_t* bitMapLoc = pagePtr + sizeof(kpage_t*);
+  unsigned char* bitMapLoc = ((pageHeader_t*)pagePtr)->bitMap;
   int segNo = (bufStartAddr / MINBUFSIZE) / BITSPERCHAR;
   int bitNo = (bufStartAddr / MINBUFSIZE) % BITSPERCHAR;
   /* look at the first bit is enough */
-  return (int)(bitMapLoc->bitSegments[segNo] & (1 << bitNo));
+  return (int)(bitMapLoc[segNo] & (1 << bitNo));
 }
 
-kma_size_t
+static kma_size_t
 get_roundup(kma_size_t reqSize)
 {
   /* round up the given size to the next power of 2,
@@ -490,4 +468,9 @@ get_roundup(kma_size_t reqSize)
   bufSize |= bufSize >> 8;
   return bufSize + 1;
 }
-#endif // KMA_BUD
+
+void
+bud_reset()
+{
+  budfls = NULL;
+}
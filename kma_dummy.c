@@ -44,7 +44,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_DUMMY
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -70,19 +69,16 @@
 
 /**************Implementation***********************************************/
 
-void* kma_malloc(kma_size_t size)
+void* dummy_malloc(kma_size_t size)
 {
   kpage_t* page;
+  int npages = (size + PAGESIZE - 1) / PAGESIZE;
   
-  // get one page
-  page = get_page();
+  // get enough continuous pages
+  page = get_pages(npages);
   
-  // add a pointer to the page structure at the beginning of the page
-  *((kpage_t**)page->ptr) = page;
-  
-  if ((size + sizeof(kpage_t*)) > page->size)
+  if (page == NULL)
     { // requested size too large
-      free_page(page);
       return NULL;
     }
   
@@ -93,16 +89,20 @@ void* kma_malloc(kma_size_t size)
   //}
   // oh yea, it worked
   
-  return page->ptr + sizeof(kpage_t*);
+  return page->ptr;
 }
 
-void kma_free(void* ptr, kma_size_t size)
+void dummy_free(void* ptr, kma_size_t size)
 {
   kpage_t* page;
   
-  page = *((kpage_t**)(ptr - sizeof(kpage_t*)));
+  // the page layer knows which page structure belongs to the page
+  page = lookup_page(ptr);
   
   free_page(page);
 }
 
-#endif // KMA_DUMMY
+void
+dummy_reset()
+{
+}
@@ -36,7 +36,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_LZBUD
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -59,13 +58,13 @@
 
 /* buffer size, number of buffer types, and page header sizes */
 #define MINBUFSIZE 32
-#define MAXBUFCLASS 8
-#define FIRSTPAGEHEADERSIZE (sizeof(pageHeader_t) + sizeof(buddyFreeLists_t))
-#define PAGEHEADERSIZE (sizeof(pageHeader_t))
+#define MAXBUFCLASS (MAXPAGESHIFT - 5) /* MAXPAGESIZE / 2 down to MINBUFSIZE */
+#define FIRSTPAGEHEADERSIZE (PAGEHEADERSIZE + sizeof(buddyFreeLists_t))
+#define PAGEHEADERSIZE (sizeof(pageHeader_t) + BITMAPSEGS)
 
-/* number of bits per char, and maximal number of bitmap segments */
+/* number of bits per char, and number of bitmap segments of a page */
 #define BITSPERCHAR 8
-#define MAXBITMAPSEGS ((PAGESIZE / MINBUFSIZE) / BITSPERCHAR)
+#define BITMAPSEGS ((PAGESIZE / MINBUFSIZE) / BITSPERCHAR)
 
 /* bitmap annotation */
 #define FREE 0
@@ -88,16 +87,11 @@ typedef struct {
   bufferHeader_t* tail;
 } freeListHeader_t;
 
-/* bitmap */
-typedef struct {
-  unsigned char bitSegments[MAXBITMAPSEGS];
-} bitMap_t;
-
-/* page header */
+/* page header, followed by the bitmap of the page */
 typedef struct {
   kpage_t* page;
-  bitMap_t bitMap;
   kma_size_t spaceUsed;
+  unsigned char bitMap[];
 } pageHeader_t;
 
 /* counters for different buffer status */
@@ -120,41 +114,41 @@ typedef struct {
 static buddyFreeLists_t* budfls = NULL;
 
 /************Function Prototypes******************************************/
-bool
-init(kma_size_t size);
-void
+static void
+init();
+static void
 header_alloc(void* pagePtr, kma_size_t headerSize);
-void*
+static void*
 big_size_alloc(kma_size_t reqSize);
-void*
+static void*
 buddy_alloc(kma_size_t reqSize);
-void
+static void
 lazy_coalesce(void* pagePtr, void* bufPtr, int bufClass, kma_size_t bufSize);
-freeListHeader_t*
+static freeListHeader_t*
 coalesce(void* pagePtr, void* bufPtr, kma_size_t bufSize);
-unsigned char
+static unsigned char
 get_buf_class(kma_size_t bufSize);
-kma_size_t
+static kma_size_t
 get_buf_size(unsigned char bufClass);
-void
+static void
 get_buffer_from_large_buffer(void* pagePtr, kma_size_t reqBufSize, unsigned char delayed,
 			     kma_size_t largeBufSize, kma_size_t largeBufStartAddr);
-bufferHeader_t*
+static bufferHeader_t*
 find_buffer_in_free_list(void* pagePtr, void* bufPtr, unsigned char bufClass,
 			 unsigned char delayed);
-void
+static void
 add_buffer_to_free_list_front(void* pagePtr, unsigned char bufClass, unsigned char delayed,
 			kma_size_t startAddr, kma_size_t bufSize);
-void
+static void
 add_buffer_to_free_list_back(void* pagePtr, unsigned char bufClass, unsigned char delayed,
 			kma_size_t startAddr, kma_size_t bufSize);
-void
+static void
 remove_buffer_from_free_list(bufferHeader_t* bufHdrPtr, unsigned char bufClass);
-void
+static void
 update_bitmap(void* pagePtr, void* bufPtr, kma_size_t bufSize, bool status);
-int
+static int
 lookup_bitmap(void* pagePtr, kma_size_t bufStartAddr);
-kma_size_t
+static kma_size_t
 get_roundup(kma_size_t reqSize);
 
 /************External Declaration*****************************************/
@@ -162,23 +156,14 @@ get_roundup(kma_size_t reqSize);
 /**************Implementation***********************************************/
 
 void*
-kma_malloc(kma_size_t size)
+lzbud_malloc(kma_size_t size)
 {
-  /* cannot allocate more than 1 page */
-  if (size > PAGESIZE) {
-    error("requested size is larger than PAGESIZE.", "");
-    return NULL;
-  }
-
   /* initialize the central data structure */
   if (budfls == NULL) {
-    /* if size is too large for keeping a page header, return */
-    if (!init(size)) {
-      return NULL;
-    }
+    init();
   }
 
-  if (PAGESIZE / 2 < size) { // the requested size needs a new page
+  if (PAGESIZE / 2 < size) { // the requested size needs new pages
     return big_size_alloc(size);
   } else { // the requested size might fit in a free buffer
     return buddy_alloc(size);
@@ -188,20 +173,20 @@ kma_malloc(kma_size_t size)
 }
 
 void 
-kma_free(void* ptr, kma_size_t size)
+lzbud_free(void* ptr, kma_size_t size)
 {
   void* pagePtr = ptr - ((long)ptr % PAGESIZE);
  
-  /* buffer occupies one page; free the page */
+  /* buffer occupies whole pages; free the pages */
   if (size > PAGESIZE / 2) {
     kpage_t* page;
-    page = *((kpage_t**)(pagePtr));
+    page = lookup_page(pagePtr);
     budfls->pagesUsed--;
 
     void* firstPagePtr = budfls->firstPagePtr;
     kma_size_t firstPageSpaceUsed = ((pageHeader_t*)(budfls->firstPagePtr))->spaceUsed;
     short pagesUsed = budfls->pagesUsed;
-    free_page(page);
+    free_pages(page);
     /* if the freed page is the second last page, 
      * and the last page (with the central information) is empty,
      * free the last page also.
@@ -272,14 +257,9 @@ kma_free(void* ptr, kma_size_t size)
   lazy_coalesce(pagePtr, ptr, bufClass, bufSize);
 }
 
-bool
-init(kma_size_t size)
+static void
+init()
 {
-  if (PAGESIZE < size + PAGEHEADERSIZE) { // the requested size cannot fit in any page
-    error("init: page size too small for requested size.", "");
-    return FALSE;
-  }
-
   kpage_t* page = get_page();
   *((kpage_t**)page->ptr) = page;
 
@@ -288,7 +268,7 @@ init(kma_size_t size)
   budfls->pagesUsed = 1;
   budfls->firstPagePtr = page->ptr;
   int i, bufSize = PAGESIZE / 2;
-  for (i = 0; i < MAXBUFCLASS; i++) {
+  for (i = 0; bufSize >= MINBUFSIZE; i++) {
     (budfls->fl[i]).size = bufSize;
     (budfls->fl[i]).ptr = NULL;
     (budfls->fl[i]).tail = NULL;
@@ -298,31 +278,31 @@ init(kma_size_t size)
   }
 
   header_alloc(page->ptr, FIRSTPAGEHEADERSIZE);
-
-  return TRUE;
 }
 
-void
+static void
 header_alloc(void* pagePtr, kma_size_t headerSize)
 {
   /* make room for the page header */
   get_buffer_from_large_buffer(pagePtr, headerSize, 0, PAGESIZE, 0);
   /* update bitmap to all 0 */
-  memset(pagePtr + sizeof(kpage_t*), '\000', MAXBITMAPSEGS);
+  memset(((pageHeader_t*)pagePtr)->bitMap, '\000', BITMAPSEGS);
   ((pageHeader_t*)pagePtr)->spaceUsed = 0;
 }
 
-void*
+static void*
 big_size_alloc(kma_size_t reqSize)
 {
-  kpage_t* page = get_page();
-  *((kpage_t**)page->ptr) = page;
+  /* for buffer larger than half page, allocate whole new pages */
+  kpage_t* page = get_pages((reqSize + PAGESIZE - 1) / PAGESIZE);
+  if (page == NULL) {
+    return NULL;
+  }
   budfls->pagesUsed++;
-  /* for buffer larger than half page, allocate a whole new page*/
-  return page->ptr + sizeof(kpage_t*) + sizeof(bitMap_t);
+  return page->ptr;
 }
 
-void*
+static void*
 buddy_alloc(kma_size_t reqSize)
 {
   kma_size_t reqBufSize = get_roundup(reqSize);
@@ -330,7 +310,7 @@ buddy_alloc(kma_size_t reqSize)
   int bufClass = reqBufClass;
   void* bufPtr;
   /* find available buffer on free lists */
-  while ((budfls->fl[bufClass]).ptr == NULL && bufClass >= 0) {
+  while (bufClass >= 0 && (budfls->fl[bufClass]).ptr == NULL) {
     bufClass--;
   }
   /* buffer found */
@@ -366,7 +346,7 @@ buddy_alloc(kma_size_t reqSize)
   return bufPtr;
 }
 
-void
+static void
 lazy_coalesce(void* pagePtr, void* bufPtr, int bufClass, kma_size_t bufSize)
 {
   short slack = (budfls->bs[bufClass]).active - (budfls->bs[bufClass]).locFree;
@@ -380,7 +360,7 @@ lazy_coalesce(void* pagePtr, void* bufPtr, int bufClass, kma_size_t bufSize)
   }
 }
 
-freeListHeader_t*
+static freeListHeader_t*
 coalesce(void* pagePtr, void* bufPtr, kma_size_t bufSize)
 {
   unsigned char bufClass = get_buf_class(bufSize);
@@ -435,21 +415,21 @@ coalesce(void* pagePtr, void* bufPtr, kma_size_t bufSize)
   }
 }
 
-unsigned char
+static unsigned char
 get_buf_class(kma_size_t bufSize)
 {
   /* translate the buffer size to a buffer class */
   return (unsigned char)((int)log2(PAGESIZE / bufSize) - 1);
 }
 
-kma_size_t
+static kma_size_t
 get_buf_size(unsigned char bufClass)
 {
   /* translate a buffer class to a buffer size */
-  return pow(2, MAXBUFCLASS - 1 - (int)bufClass) * MINBUFSIZE;
+  return (PAGESIZE / 2) >> bufClass;
 }
 
-void
+static void
 get_buffer_from_large_buffer(void* pagePtr, kma_size_t reqBufSize, unsigned char delayed,
 			     kma_size_t largeBufSize, kma_size_t largeBufStartAddr)
 {
@@ -474,7 +454,7 @@ get_buffer_from_large_buffer(void* pagePtr, kma_size_t reqBufSize, unsigned char
   }
 }
 
-bufferHeader_t*
+static bufferHeader_t*
 find_buffer_in_free_list(void* pagePtr, void* bufPtr, unsigned char bufClass,
 			 unsigned char delayed)
 {
@@ -492,7 +472,7 @@ find_buffer_in_free_list(void* pagePtr, void* bufPtr, unsigned char bufClass,
   return NULL;
 }
 
-void
+static void
 add_buffer_to_free_list_front(void* pagePtr, unsigned char bufClass, unsigned char delayed,
 			     kma_size_t bufStartAddr, kma_size_t bufSize)
 {
@@ -513,7 +493,7 @@ add_buffer_to_free_list_front(void* pagePtr, unsigned char bufClass, unsigned ch
   (budfls->fl[(int)bufClass]).ptr = bufHdrPtr;
 }
 
-void
+static void
 add_buffer_to_free_list_back(void* pagePtr, unsigned char bufClass, unsigned char delayed,
 			     kma_size_t bufStartAddr, kma_size_t bufSize)
 {
@@ -534,7 +514,7 @@ add_buffer_to_free_list_back(void* pagePtr, unsigned char bufClass, unsigned cha
   (budfls->fl[(int)bufClass]).tail = bufHdrPtr;
 }
 
-void
+static void
 remove_buffer_from_free_list(bufferHeader_t* bufHdrPtr, unsigned char bufClass)
 {
   // get a buffer from a free list
@@ -556,15 +536,15 @@ remove_buffer_from_free_list(bufferHeader_t* bufHdrPtr, unsigned char bufClass)
   }
 }
 
-void
+static void
 update_bitmap(void* pagePtr, void* bufPtr, kma_size_t bufSize, bool status)
 {
   int totalBits = bufSize / MINBUFSIZE;
   int i;
   unsigned char mask = 0xff;
-  bitMap_t* bitMapLoc = pagePtr + sizeof(kpage_t*);
+  unsigned char* bitMapLoc = ((pageHeader_t*)pagePtr)->bitMap;
   kma_size_t bufStartAddr = (long)bufPtr - (long)pagePtr;
-  /* the 256 bits bitmap is stored in 8 unsigned chars;
+  /* the bitmap holds one bit per MINBUFSIZE bytes of the page;
    * segNo is the index of a char;
    * bitNo is the index of a bit in the char.
    */
@@ -576,9 +556,9 @@ update_bitmap(void* pagePtr, void* bufPtr, kma_size_t bufSize, bool status)
       mask -= 1 << i;
     }
     if (status == FREE) {
-      bitMapLoc->bitSegments[segNo] &= mask;
+      bitMapLoc[segNo] &= mask;
     } else {
-      bitMapLoc->bitSegments[segNo] |= ~mask;
+      bitMapLoc[segNo] |= ~mask;
     }
     return;
   }
@@ -591,17 +571,17 @@ update_bitmap(void* pagePtr, void* bufPtr, kma_size_t bufSize, bool status)
 
 }
 
-int
+static int
 lookup_bitmap(void* pagePtr, kma_size_t bufStartAddr)
 {
-  bitMap_t* bitMapLoc = pagePtr + sizeof(kpage_t*);
+  unsigned char* bitMapLoc = ((pageHeader_t*)pagePtr)->bitMap;
   int segNo = (bufStartAddr / MINBUFSIZE) / BITSPERCHAR;
   int bitNo = (bufStartAddr / MINBUFSIZE) % BITSPERCHAR;
   /* look at the first bit is enough */
-  return (int)(bitMapLoc->bitSegments[segNo] & (1 << bitNo));
+  return (int)(bitMapLoc[segNo] & (1 << bitNo));
 }
 
-kma_size_t
+static kma_size_t
 get_roundup(kma_size_t reqSize)
 {
   /* round up the given size to the next power of 2,
@@ -618,4 +598,9 @@ get_roundup(kma_size_t reqSize)
   bufSize |= bufSize >> 8;
   return bufSize + 1;
 }
-#endif // KMA_LZBUD
+
+void
+lzbud_reset()
+{
+  budfls = NULL;
+}
@@ -36,7 +36,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_MCK2
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -58,41 +57,13 @@
 #define FALSE 0
 #define TRUE 1
 #define MAXSPACE (PAGESIZE - sizeof(kpage_t*) - sizeof(mck2Header_t))
-#define PAGEOFFSET 0x1fff
-#define MASKOFFSET ~PAGEOFFSET
-
-#define NDX(size) \
-					(size < BUFSIZE0) ? 0 \
-				: (size < BUFSIZE1) ? 1 \
-				: (size < BUFSIZE2) ? 2 \
-				: (size < BUFSIZE3) ? 3 \
-				: (size < BUFSIZE4) ? 4 \
-				: (size < BUFSIZE5) ? 5 \
-				: (size < BUFSIZE6) ? 6 \
-				: (size < BUFSIZE7) ? 7 \
-				: 8;
-
-#define MAXSET 9
-#define BUFSIZE0 1<<5
-#define BUFSIZE1 1<<6
-#define BUFSIZE2 1<<7
-#define BUFSIZE3 1<<8
-#define BUFSIZE4 1<<9
-#define BUFSIZE5 1<<10
-#define BUFSIZE6 1<<11
-#define BUFSIZE7 1<<12
-#define BUFSIZE8 MAXSPACE 
-#define SPACE(idx) \
-					(idx == 0) ? BUFSIZE0 \
-				:	(idx == 1) ? BUFSIZE1 \
-				:	(idx == 2) ? BUFSIZE2 \
-				:	(idx == 3) ? BUFSIZE3 \
-				:	(idx == 4) ? BUFSIZE4 \
-				:	(idx == 5) ? BUFSIZE5 \
-				:	(idx == 6) ? BUFSIZE6 \
-				:	(idx == 7) ? BUFSIZE7 \
-				:	(idx == 8) ? BUFSIZE8 \
-				: BUFSIZE8
+#define PAGEOFFSET (PAGESIZE - 1)
+#define MASKOFFSET (~(unsigned long)PAGEOFFSET)
+
+// power of two buffer sizes from BUFSIZE0 up to half a page,
+// followed by one class of MAXSPACE
+#define BUFSIZE0 (1 << 5)
+#define NUMPOW2 (PAGESHIFT - 5)
 
 // Header in each buffer
 typedef struct buf_header
@@ -112,27 +83,39 @@ typedef struct mck2_header
 
 /************Global Variables*********************************************/
 // Pointer to the current page header
-mck2Header_t* mck2Ptr = NULL;
+static mck2Header_t* mck2Ptr = NULL;
 
 /************Function Prototypes******************************************/
 // search the free buffer in pages
-mck2Header_t* searchFreelist(kma_size_t);
+static mck2Header_t* searchFreelist(kma_size_t);
 
 // initialize the page header
-int initMck2(kma_size_t);
+static int initMck2(kma_size_t);
+
+// size class of a request, and the buffer size of a class
+static int sizeIndex(kma_size_t);
+static kma_size_t indexSpace(int);
 
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
 void*
-kma_malloc(kma_size_t size)
+mck2_malloc(kma_size_t size)
 {
-	// check if the request is valid
-	if(size > PAGESIZE)
+	// if the request size larger than half page
+	// return whole continuous pages
+	if(size > MAXSPACE / 2)
 	{
-		printf("ERROR: not enough space!\n");
-		return NULL;
+		kpage_t* page;
+		page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+		// NULL tells the caller; no printing here, stdio may allocate,
+		// which the malloc library serves from this very allocator
+		if(page == NULL)
+		{
+			return NULL;
+		}
+		return page->ptr;
 	}
 
 	// if no page is present in kernel
@@ -141,23 +124,12 @@ kma_malloc(kma_size_t size)
 	{
 		if(initMck2(size))
 		{
-			printf("ERROR: too large size!\n");
 			return NULL;
 		}
 	}
 
-	// if the request size larger than half page
-	// return the whole page
-	if(size > MAXSPACE / 2)
-	{
-		kpage_t* page;
-		page = get_page();
-		*((kpage_t**)(page->ptr)) = page;
-		return page->ptr + sizeof(kpage_t*);
-	}
-
-	int index = NDX(size);
-	kma_size_t reqSpace = SPACE(index);
+	int index = sizeIndex(size);
+	kma_size_t reqSpace = indexSpace(index);
 	bufHeader_t* bufPtr = NULL;
 
 //	printf("size: %d\tindex: %d\t request space: %d\n", size, index, reqSpace);
@@ -184,14 +156,14 @@ kma_malloc(kma_size_t size)
 }
 
 void
-kma_free(void* ptr, kma_size_t size)
+mck2_free(void* ptr, kma_size_t size)
 {
 	// if the return size larger than half page
-	// free the whole page
+	// free the whole pages
 	if(size > MAXSPACE / 2)
 	{
-		kpage_t* page = *((kpage_t**)((void*)ptr - sizeof(kpage_t*)));
-		free_page(page);
+		kpage_t* page = lookup_page(ptr);
+		free_pages(page);
 		return;
 	}
 
@@ -204,8 +176,8 @@ kma_free(void* ptr, kma_size_t size)
 	}
 	else	// return the buffer to the buffer list
 	{
-		int index = NDX(size);
-		kma_size_t reqSpace = SPACE(index);
+		int index = sizeIndex(size);
+		kma_size_t reqSpace = indexSpace(index);
 		bufHeader_t* bufPtr = (bufHeader_t*)ptr;
 		bufPtr->ptr = tempMck2Ptr->bufferPtr;
 		tempMck2Ptr->bufferPtr = bufPtr;
@@ -245,7 +217,7 @@ kma_free(void* ptr, kma_size_t size)
 }
 
 // find a free buffer in the list
-mck2Header_t* searchFreelist(kma_size_t reqSpace)
+static mck2Header_t* searchFreelist(kma_size_t reqSpace)
 {
 	mck2Header_t* curMck2Ptr = mck2Ptr;
 	while(curMck2Ptr != NULL)
@@ -260,10 +232,10 @@ mck2Header_t* searchFreelist(kma_size_t reqSpace)
 }
 
 // initialize a new page
-int initMck2(kma_size_t size)
+static int initMck2(kma_size_t size)
 {
-	int index = NDX(size);
-	kma_size_t reqSpace = SPACE(index);
+	int index = sizeIndex(size);
+	kma_size_t reqSpace = indexSpace(index);
 
 	kpage_t* page;
 	page = get_page();
@@ -306,4 +278,30 @@ int initMck2(kma_size_t size)
 	mck2Ptr = curMck2Ptr;
 	return 0;
 }
-#endif // KMA_MCK2
+
+// the smallest class whose buffers are larger than size
+static int sizeIndex(kma_size_t size)
+{
+	int idx = 0;
+	while(idx < NUMPOW2 && size >= (BUFSIZE0 << idx))
+	{
+		idx++;
+	}
+	return idx;
+}
+
+// buffer size of a class
+static kma_size_t indexSpace(int idx)
+{
+	if(idx < NUMPOW2)
+	{
+		return BUFSIZE0 << idx;
+	}
+	return MAXSPACE;
+}
+
+void
+mck2_reset()
+{
+  mck2Ptr = NULL;
+}
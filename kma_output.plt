@@ -1,13 +1,21 @@
+# kma_output.dat holds records of 17 ints: trace index, bytes allocated,
+# page bytes in use, and bytes allocated per size class (<=16, <=32, ...,
+# <=65536, larger)
 set style data lines
 set term png
 set output "kma_output.png"
 set xlabel "allocation trace index"
 set ylabel "bytes"
-plot "kma_output.dat" using 1:2 title 'bytes allocated', '' using 1:3 title 'page bytes in use'
+plot "kma_output.dat" binary format="%17int32" using 1:2 title 'bytes allocated', '' binary format="%17int32" using 1:3 title 'page bytes in use'
 
 w(x, y) = (y - x) / x
 
 set output "kma_waste.png"
 set ylabel "inefficiency"
 set logscale y
-plot "kma_output.dat" using 1:(w($2,$3)) title 'inefficiency'
+plot "kma_output.dat" binary format="%17int32" using 1:(w($2,$3)) title 'inefficiency'
+
+set output "kma_classes.png"
+set ylabel "bytes"
+unset logscale y
+plot for [c=4:17] "kma_output.dat" binary format="%17int32" using 1:c title (c < 17 ? sprintf("<=%d", 2**c) : ">65536")
@@ -36,7 +36,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_P2FL
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -57,38 +56,12 @@
 #define FALSE 0
 #define TRUE	1
 #define MAXSPACE (PAGESIZE - sizeof(kpage_t*) - sizeof(kflHeader_t) - sizeof(bufHeader_t))
-#define MAXSET 9
-#define BUFSIZE0 1<<5
-#define BUFSIZE1 1<<6
-#define BUFSIZE2 1<<7
-#define BUFSIZE3 1<<8
-#define BUFSIZE4 1<<9
-#define BUFSIZE5 1<<10
-#define BUFSIZE6 1<<11
-#define BUFSIZE7 1<<12
-#define BUFSIZE8 MAXSPACE 
-#define NDX(size) \
-					(size <= BUFSIZE0) ? 0 \
-				: (size <= BUFSIZE1) ? 1 \
-				: (size <= BUFSIZE2) ? 2 \
-				: (size <= BUFSIZE3) ? 3 \
-				: (size <= BUFSIZE4) ? 4 \
-				: (size <= BUFSIZE5) ? 5 \
-				: (size <= BUFSIZE6) ? 6 \
-				: (size <= BUFSIZE7) ? 7 \
-				: 8;
 
-#define SPACE(idx) \
-					(idx == 0) ? BUFSIZE0 \
-				:	(idx == 1) ? BUFSIZE1 \
-				:	(idx == 2) ? BUFSIZE2 \
-				:	(idx == 3) ? BUFSIZE3 \
-				:	(idx == 4) ? BUFSIZE4 \
-				:	(idx == 5) ? BUFSIZE5 \
-				:	(idx == 6) ? BUFSIZE6 \
-				:	(idx == 7) ? BUFSIZE7 \
-				:	(idx == 8) ? BUFSIZE8 \
-				: BUFSIZE8;
+// power of two buffer sizes from BUFSIZE0 up to half a page,
+// followed by one class of MAXSPACE; MAXSET covers MAXPAGESIZE
+#define BUFSIZE0 (1 << 5)
+#define NUMPOW2 (PAGESHIFT - 5)
+#define MAXSET (MAXPAGESHIFT - 5 + 1)
 
 // Buffer header on the top of each buffer
 typedef struct buffer_header
@@ -108,31 +81,39 @@ typedef struct k_freelist
 
 /************Global Variables*********************************************/
 // Pointer to the current page header
-kflHeader_t* kflPtr = NULL;
+static kflHeader_t* kflPtr = NULL;
 
 /************Function Prototypes******************************************/
 // Initialize the header in the new page
 // Also, contains the freelist of all available buffers
-int initKFL(kma_size_t);
+static int initKFL(kma_size_t);
 
 // free all pages
-void cleanupKFL();
+static void cleanupKFL();
 
 // If the space left in the page cannot meet the request
 // cut the space into smaller size and put them on freelist
-void allocSpaceLeft(int);
+static void allocSpaceLeft(int);
+
+// Size class of a request, and the buffer size of a class
+static int sizeIndex(kma_size_t);
+static kma_size_t indexSpace(int);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
 void*
-kma_malloc(kma_size_t size)
+p2fl_malloc(kma_size_t size)
 {
-	// Check if the request is valid
-	if(size > MAXSPACE)
+	// If the request size is larger than half page
+	// simply return whole continuous pages
+	if(size > MAXSPACE / 2)
 	{
-		printf("ERROR: too large request!\n");
-		return NULL;
+		kpage_t* page;
+		page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+		if(page == NULL)
+			return NULL;
+		return page->ptr;
 	}
 
 	// If no page is present in kernel
@@ -142,20 +123,10 @@ kma_malloc(kma_size_t size)
 		if(initKFL(size))
 			return NULL;
 	}
-
-	// If the request size is larger than half page
-	// simply return a whole page
-	if(size > MAXSPACE / 2)
-	{
-		kpage_t* page;
-		page = get_page();
-		*((kpage_t**)(page->ptr)) = page;
-		return page->ptr + sizeof(kpage_t*);
-	}
 	
 	// Roundup the size and calculate the index and size
-	int index = NDX(size + sizeof(bufHeader_t));
-	kma_size_t reqSpace = SPACE(index);
+	int index = sizeIndex(size + sizeof(bufHeader_t));
+	kma_size_t reqSpace = indexSpace(index);
 	bufHeader_t* bufPtr;
 	bool reqNewPage;
 //	printf("size: %d\tindex: %d\t request space: %d\n", size, index, reqSpace);
@@ -191,20 +162,20 @@ kma_malloc(kma_size_t size)
 }
 
 void
-kma_free(void* ptr, kma_size_t size)
+p2fl_free(void* ptr, kma_size_t size)
 {
 	// return size is larger than half page
-	// simply free the page
+	// simply free the pages
 	if(size > MAXSPACE / 2)
 	{
-		kpage_t* page = *((kpage_t**)((void*)ptr - sizeof(kpage_t*)));
-		free_page(page);
+		kpage_t* page = lookup_page(ptr);
+		free_pages(page);
 		return;
 	}
 
 	// put the return buffer into the freelist
-	int index = NDX(size + sizeof(bufHeader_t));
-	kma_size_t reqSpace = SPACE(index);
+	int index = sizeIndex(size + sizeof(bufHeader_t));
+	kma_size_t reqSpace = indexSpace(index);
  	bufHeader_t* bufPtr;
 	bufPtr = (bufHeader_t*)(ptr - sizeof(bufHeader_t));
 	bufPtr->ptr = kflPtr->p2fl[index];
@@ -216,14 +187,14 @@ kma_free(void* ptr, kma_size_t size)
 }
 
 // put the rest of the page into the freelist
-void
+static void
 allocSpaceLeft(int index)
 {
 	bufHeader_t* bufPtr;
 	kma_size_t reqSpace;
 	while(index >= 0)
 	{
-		reqSpace = SPACE(index);
+		reqSpace = indexSpace(index);
 		while((kflPtr->freespaceSize - reqSpace) >= 0)
 		{	
 			bufPtr = (bufHeader_t*) kflPtr->freespacePtr;
@@ -236,7 +207,7 @@ allocSpaceLeft(int index)
 }
 
 // free all pages in kernel
-void
+static void
 cleanupKFL()
 {
 	if(kflPtr->spaceUsed == 0)
@@ -254,7 +225,7 @@ cleanupKFL()
 }
 
 // initialize the new page
-int initKFL(kma_size_t size)
+static int initKFL(kma_size_t size)
 {
 	kpage_t* page;
 	page = get_page();
@@ -303,4 +274,29 @@ int initKFL(kma_size_t size)
 	return 0;
 }
 
-#endif // KMA_P2FL
+// the smallest class whose buffers hold size
+static int sizeIndex(kma_size_t size)
+{
+	int idx = 0;
+	while(idx < NUMPOW2 && size > (BUFSIZE0 << idx))
+	{
+		idx++;
+	}
+	return idx;
+}
+
+// buffer size of a class
+static kma_size_t indexSpace(int idx)
+{
+	if(idx < NUMPOW2)
+	{
+		return BUFSIZE0 << idx;
+	}
+	return MAXSPACE;
+}
+
+void
+p2fl_reset()
+{
+  kflPtr = NULL;
+}
@@ -35,7 +35,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_RM
 #define __KMA_IMPL__
 
 /************System include***********************************************/
@@ -53,310 +52,465 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* buffer sizes are kept in multiples of ALIGN; a free buffer holds its
+ * bin links and its footer, so it is never smaller than MINSIZE */
+#define ALIGN 8
+#define MINSIZE ROUNDUP(sizeof(binlinks) + sizeof(int))
+#define ROUNDUP(size) (((size) + ALIGN - 1) & ~(ALIGN - 1))
+
+/* free buffers are kept in bins by size, for best-fit allocation
+ * without walking a free list: BINSMALL bins BINSTEP bytes apart for
+ * small sizes, then BINSUB bins per power of two */
+#define BINSTEP 16
+#define BINSMALL 32
+#define BINSMALLSHIFT 9   /* log2(BINSMALL * BINSTEP) */
+#define BINSUBBITS 2
+#define BINSUB (1 << BINSUBBITS)
+#define NBINS (BINSMALL + (MAXPAGESHIFT - BINSMALLSHIFT) * BINSUB)
+
+/* where a request is placed among the free buffers that fit:
+ *  RM_FIRSTFIT  the first one met, from the bin of the request up
+ *  RM_NEXTFIT   the first one met from where the last search stopped
+ *  RM_BESTFIT   the smallest one, the lowest of equal sizes
+ *  RM_WORSTFIT  the largest one */
+#define RM_FIRSTFIT 0
+#define RM_NEXTFIT 1
+#define RM_BESTFIT 2
+#define RM_WORSTFIT 3
+
+#ifndef RM_POLICY
+#define RM_POLICY RM_BESTFIT
+#endif
+
+/* the flags of a buffer header */
+#define FREE 1       /* the buffer is free */
+#define PREVFREE 2   /* the buffer before it in the page is free */
+
+/* the bytes of a page buffers can take, and the data of a buffer
+ * spanning all of them */
+#define PAGESPACE (PAGESIZE - sizeof(pagehead))
+#define PAGEFREE (PAGESPACE - sizeof(bufhead))
+
+/* pages are aligned to their size, the page of a buffer is found
+ * from its address */
+#define PAGEOF(buffer) ((pagehead*)((long int)(buffer) & ~((long int)PAGESIZE - 1)))
+#define DATA(buffer) ((void*)((bufhead*)(buffer) + 1))
+#define NEXT(buffer) ((bufhead*)((long int)DATA(buffer) + (buffer)->size))
+#define LASTINPAGE(buffer) ((long int)NEXT(buffer) == (long int)PAGEOF(buffer) + PAGESIZE)
+
+/* a free buffer holds its bin links at the start of its data and its
+ * size in a footer at the end, for the buffer after it to coalesce */
+#define LINKS(buffer) ((binlinks*)DATA(buffer))
+#define FOOTER(buffer) ((int*)NEXT(buffer) - 1)
+
 /************Global Variables*********************************************/
-kpage_t *entry = NULL;
+static void *bins[NBINS];
+static unsigned long long binmap = 0;   /* the non-empty bins */
+
+static void *rover = NULL;             /* where next-fit goes on */
+static long long searched = 0;         /* free buffers looked at */
 
 /************External Declaration*****************************************/
+/* the header of every buffer, 8 bytes in front of its data; with the
+ * footer of a free buffer before it, it is the boundary tag a freed
+ * buffer finds its free neighbours in the page by */
 typedef struct
 {
-  int size;
-  void *base;
-  void *prev;
-  void *next;
+  int size;    /* the bytes of data */
+  int flags;
 }bufhead;
 
 typedef struct
 {
-  kpage_t **page;
-  bufhead *freelist;
-//  int counter;
+  kpage_t *page;
+  int counter;   /* the bytes no buffer in use takes */
 }pagehead;
-/************Function Prototypes******************************************/
-void 
-init();
 
-void*
+typedef struct
+{
+  void *prev;
+  void *next;
+}binlinks;
+/************Function Prototypes******************************************/
+static void*
 alloc(bufhead *buffer ,int size);
 
-void 
-giveback(bufhead *buffer);
+static void
+settag(bufhead *buffer, int size, int free);
 
-void
+static void
+setprevfree(bufhead *buffer, int free);
+
+static bufhead*
 merge(bufhead *buffer);
 
-void
-fpage();
+static void*
+bigalloc(int size);
+
+static void
+bigfree(void *ptr);
+
+static int
+binindex(int size);
+
+static void
+binput(bufhead *buffer);
+
+static void
+bintake(bufhead *buffer);
+
+static bufhead*
+binfind(int size);
+
+#if RM_POLICY == RM_FIRSTFIT || RM_POLICY == RM_BESTFIT
+static bufhead*
+fit(int size, int best);
+#elif RM_POLICY == RM_NEXTFIT
+static bufhead*
+nextfit(int size);
+
+static bufhead*
+binnext(bufhead *buffer, int first);
+#elif RM_POLICY == RM_WORSTFIT
+static bufhead*
+worstfit(int size);
+#else
+#error "RM_POLICY is none of RM_FIRSTFIT, RM_NEXTFIT, RM_BESTFIT, RM_WORSTFIT"
+#endif
 /**************Implementation***********************************************/
 
 void*
-kma_malloc(kma_size_t size)
+rm_malloc(kma_size_t size)
 {
   kpage_t *newpage;
-  pagehead *first, *second;
-  bufhead  *buffer, *follow, *newbuf;
+  pagehead *head;
+  bufhead  *buffer;
 
-//  printf("%d\n",size); 
- 
   if(size + sizeof(pagehead) + sizeof(bufhead) > PAGESIZE)
-     return NULL;
+     return bigalloc(size);
    
-  if(entry == NULL)
-    init();
-  
-  first = (pagehead*)entry->ptr;
-  buffer = (bufhead*)first->freelist;
-
-  follow = NULL;
-  while(buffer!=NULL && buffer->size < size)
-  {
-    follow = buffer;
-    buffer = (bufhead*)buffer->next;
-  }
+  size = size < MINSIZE ? MINSIZE : ROUNDUP(size);
+  buffer = binfind(size);
 
-  if(buffer != NULL)
-    return alloc(buffer, size);
-  else
+  if(buffer == NULL)
   {
     newpage = get_page();
-    *((kpage_t**)newpage->ptr) = newpage;
-//    first->counter++;   
-    second = (pagehead*)newpage->ptr;
-    second->freelist = NULL;
-//    second->counter = 0;
+    assert(((long int)newpage->ptr & (PAGESIZE - 1)) == 0);
+    head = (pagehead*)newpage->ptr;
+    head->page = newpage;
+    head->counter = PAGESPACE;
        
-    newbuf = (bufhead*)((long int)newpage->ptr + sizeof(pagehead));
-    newbuf->size = PAGESIZE - sizeof(pagehead) - sizeof(bufhead);
-    newbuf->base = (void*)((long int)newbuf + sizeof(bufhead));
-    
-    if(follow == NULL)
-    {
-      first->freelist = newbuf;
-      newbuf->next = NULL;
-      newbuf->prev = NULL;
-    }
-    else
-    {
-      newbuf->prev = (void*)follow;
-      newbuf->next = NULL;
-      follow->next = (void*)newbuf;
-    }
-         
-    return alloc(newbuf, size);
+    buffer = (bufhead*)((long int)head + sizeof(pagehead));
+    buffer->flags = 0;
+    settag(buffer, PAGEFREE, TRUE);
+    binput(buffer);
   }   
+
+  return alloc(buffer, size);
 }
 
 
 void
-kma_free(void* ptr, kma_size_t size)
+rm_free(void* ptr, kma_size_t size)
 {
-  pagehead *first;
+  pagehead *head;
   bufhead *buffer;
    
-  first  = (pagehead*)entry->ptr;
-  buffer = (bufhead*)((long int)ptr - sizeof(bufhead));
-  
-  giveback(buffer);
-
-  merge(buffer);
- 
-  fpage(); 
-}
+  if(size + sizeof(pagehead) + sizeof(bufhead) > PAGESIZE)
+  {
+    bigfree(ptr);
+    return;
+  }
 
-void
-fpage()
-{
-  kpage_t* page;
-  pagehead*first, *second;
-  bufhead *front, *rear;
-  void* freepage;  
+  buffer = (bufhead*)ptr - 1;
+  head = PAGEOF(buffer);
+  head->counter += buffer->size + sizeof(bufhead);
 
-  first = (pagehead*)entry->ptr;
+  buffer = merge(buffer);
 
-  front = (bufhead*)first->freelist;
-  rear = NULL;
-  
-  if(front == NULL) return;
-  
-  while(front != NULL)
+  /* the last buffer in use of the page is gone, wherever the page is */
+  if(head->counter == PAGESPACE)
   {
-    rear = front;
-    front = (bufhead*)front->next;
-  }//find the rear 
- 
-  front = (bufhead*)rear->prev;
-  if(rear->size == PAGESIZE - sizeof(pagehead) - sizeof(bufhead))
-  { 
-    if(front == NULL)
-       first->freelist = NULL;
-    else
-       front->next = NULL;
-  
-    freepage = (void*)((long int)rear - sizeof(pagehead));
-    second = (pagehead*)freepage;
-    page = (kpage_t*)second->page;
-    
-//    printf("page->id %d\n",page->id);
-    if(page->id == 0)
-    {
-      entry = NULL;
-      free_page(page);
-      return;
-    }
-    else
-    {
-      if(first->freelist == NULL)
-      {
-        free_page(page);
-        return;
-      }
-      else
-      {
-        free_page(page);
-        fpage();
-      } 
-    }
+    assert(buffer->size == PAGEFREE);
+    free_page(head->page);
   }
-    
+  else
+    binput(buffer);
 }
 
 
-void init()
+/* requests that do not fit in one page get their own continuous pages */
+static void* bigalloc(int size)
 {
-  pagehead *first;
-  bufhead *buffer;
-   
-  entry = get_page();
-  *((kpage_t**)entry->ptr) = entry;
-     
-  first = (pagehead*)entry->ptr;
-  buffer = (bufhead*)((long int)entry->ptr + sizeof(pagehead)); 
-
-  first->freelist = (void*)buffer;
-//  first->counter = 1;
-
-  buffer->size = PAGESIZE - sizeof(pagehead) - sizeof(bufhead);
-  buffer->base = (void*)((long int)buffer + sizeof(bufhead));
-  buffer->prev = NULL;
-  buffer->next = NULL;    
+  kpage_t *pages;
+
+  pages = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+  if(pages == NULL)
+    return NULL;
+
+  return pages->ptr;
+}
+
+static void bigfree(void *ptr)
+{
+  free_pages(lookup_page(ptr));
 }
 
-void* alloc(bufhead* buffer, int size)
+static void* alloc(bufhead* buffer, int size)
 {
-  pagehead *first;
-  bufhead *newbuf = NULL, *front, *rear, *temp;
+  bufhead *newbuf;
 
-  first = (pagehead*)entry->ptr;
-  
-  if(buffer->size > size + sizeof(bufhead))
+  bintake(buffer);
+  if(buffer->size >= size + sizeof(bufhead) + MINSIZE)
   {
-    /* create a new buffer head */
-    newbuf = (bufhead*)((long int)buffer + sizeof(bufhead) + size);
-    newbuf->size = buffer->size - size -sizeof(bufhead);  
-    newbuf->base = (void*)((long int)newbuf + sizeof(bufhead));
-    newbuf->prev = (void*)buffer;
-    newbuf->next = (void*)buffer->next;
-    /* add the new buffer into free list */
-    temp = (bufhead*)buffer->next;
-    if(temp != NULL)
-    	temp->prev = (void*)newbuf;
-    buffer->next = (void*)newbuf;
+    /* the rest of the buffer becomes a free buffer of its own */
+    newbuf = (bufhead*)((long int)DATA(buffer) + size);
+    newbuf->flags = 0;
+    settag(newbuf, buffer->size - size - sizeof(bufhead), TRUE);
+    binput(newbuf);
     
     buffer->size = size;
   }
 
-  front = (bufhead*)buffer->prev;
-  rear  = (bufhead*)buffer->next;
+  settag(buffer, buffer->size, FALSE);
+  PAGEOF(buffer)->counter -= buffer->size + sizeof(bufhead);
+  return DATA(buffer);
+}
 
-  if(front == NULL)
-  {
-    first->freelist = (void*)rear;
-    if(rear)
-    	rear->prev = NULL;
-    return buffer->base;
-  }  
-  else
+/* sets the size and free flag of a buffer, and tells the buffer after
+ * it whether it is free */
+static void settag(bufhead *buffer, int size, int free)
+{
+  buffer->size = size;
+  if(free)
   {
-    front->next = rear;
-    if(rear)
-    	rear->prev = (void*)front;
-    return buffer->base;
+    buffer->flags |= FREE;
+    *FOOTER(buffer) = size;
   }
+  else
+    buffer->flags &= ~FREE;
+
+  if(!LASTINPAGE(buffer))
+    setprevfree(NEXT(buffer), free);
 }
 
-void giveback(bufhead *buffer)
+static void setprevfree(bufhead *buffer, int free)
+{
+  if(free)
+    buffer->flags |= PREVFREE;
+  else
+    buffer->flags &= ~PREVFREE;
+}
+
+/* coalesces a freed buffer with the free buffers next to it in its
+ * page, returns the free buffer they make up */
+static bufhead* merge(bufhead *buffer)
 {
-  pagehead *first;
   bufhead *front, *rear;
-  
-  first = (pagehead*)entry->ptr;
-  /* 1.put it back to the free list */
-  front = (bufhead*)first->freelist;
-  if(front == NULL)
+  int size = buffer->size;
+
+  if(!LASTINPAGE(buffer))
   {
-    first->freelist = buffer;
-    buffer->prev = NULL;
-    buffer->next = NULL;
+    front = NEXT(buffer);
+    if(front->flags & FREE)
+    {
+      bintake(front);
+      size = size + sizeof(bufhead) + front->size;
+    }
   }
+
+  if(buffer->flags & PREVFREE)
+  {
+    rear = (bufhead*)((long int)buffer - *((int*)buffer - 1) - sizeof(bufhead));
+    bintake(rear);
+    size = size + sizeof(bufhead) + rear->size;
+    buffer = rear;
+  }
+
+  settag(buffer, size, TRUE);
+  return buffer;
+}
+
+/* bins BINSTEP bytes apart up to BINSMALL * BINSTEP, then BINSUB bins
+ * per power of two */
+static int binindex(int size)
+{
+  int shift;
+
+  if(size < BINSMALL * BINSTEP)
+    return size / BINSTEP;
+
+  shift = 31 - __builtin_clz(size);
+  return BINSMALL + (shift - BINSMALLSHIFT) * BINSUB
+    + ((size >> (shift - BINSUBBITS)) & (BINSUB - 1));
+}
+
+static void binput(bufhead *buffer)
+{
+  int i = binindex(buffer->size);
+  binlinks *links = LINKS(buffer);
+
+  links->prev = NULL;
+  links->next = bins[i];
+  if(bins[i] != NULL)
+    LINKS((bufhead*)bins[i])->prev = (void*)buffer;
+  bins[i] = (void*)buffer;
+  binmap |= 1ULL << i;
+}
+
+static void bintake(bufhead *buffer)
+{
+  int i = binindex(buffer->size);
+  binlinks *links = LINKS(buffer);
+
+  if(links->prev == NULL)
+    bins[i] = links->next;
   else
-  { 
-    rear = NULL;
-    while(front!=NULL && front < buffer)
+    LINKS((bufhead*)links->prev)->next = links->next;
+  if(links->next != NULL)
+    LINKS((bufhead*)links->next)->prev = links->prev;
+
+  if(bins[i] == NULL)
+    binmap &= ~(1ULL << i);
+
+  if(buffer == rover)
+    rover = links->next;
+}
+
+/* a free buffer of at least size bytes placed by RM_POLICY, fixed at
+ * compile time; all the buffers from the bin of size up fit, except
+ * some of that bin */
+static bufhead* binfind(int size)
+{
+#if RM_POLICY == RM_FIRSTFIT
+  return fit(size, FALSE);
+#elif RM_POLICY == RM_NEXTFIT
+  return nextfit(size);
+#elif RM_POLICY == RM_WORSTFIT
+  return worstfit(size);
+#else
+  return fit(size, TRUE);
+#endif
+}
+
+#if RM_POLICY == RM_FIRSTFIT || RM_POLICY == RM_BESTFIT
+/* first-fit, or best-fit with the lowest of equal sizes, up the bins */
+static bufhead* fit(int size, int best)
+{
+  int i = binindex(size);
+  bufhead *buffer, *found = NULL;
+  unsigned long long larger;
+
+  for(;;)
+  {
+    for(buffer = (bufhead*)bins[i]; buffer != NULL;
+        buffer = (bufhead*)LINKS(buffer)->next)
     {
-      rear = front;
-      front = (bufhead*)front->next;
+      searched++;
+      if(buffer->size < size)
+        continue;
+      if(!best)
+        return buffer;
+      if(found == NULL || buffer->size < found->size
+         || (buffer->size == found->size && buffer < found))
+        found = buffer;
     }
+    if(found != NULL)
+      return found;
 
-    if(rear == NULL)
-    { 
-      first->freelist = (void*)buffer;
-      buffer->prev = NULL;
-      buffer->next = (void*)front;
-      front->prev = (void*)buffer;
-    }
-    else
+    larger = binmap & ~((2ULL << i) - 1);
+    if(larger == 0)
+      return NULL;
+    i = __builtin_ctzll(larger);
+  }
+}
+#endif
+
+#if RM_POLICY == RM_NEXTFIT
+/* the first fitting buffer from the rover on, if the rover is in a bin
+ * that may fit, around the bins from the bin of size up */
+static bufhead* nextfit(int size)
+{
+  int i = binindex(size);
+  bufhead *buffer, *start;
+
+  start = (bufhead*)rover;
+  if(start == NULL || binindex(start->size) < i)
+    start = binnext(NULL, i);
+
+  for(buffer = start; buffer != NULL; )
+  {
+    searched++;
+    if(buffer->size >= size)
     {
-      buffer->prev = (void*)rear;
-      buffer->next = (void*)front;
-      rear->next = (void*)buffer;
-      if(front != NULL)
-      	front->prev = (void*)buffer;
+      rover = (void*)binnext(buffer, i);
+      return buffer;
     }
+    buffer = binnext(buffer, i);
+    if(buffer == start)
+      break;
   }
+  return NULL;
 }
+#endif
 
-void merge(bufhead *buffer)
+#if RM_POLICY == RM_WORSTFIT
+/* the largest buffer, in the highest bin holding any */
+static bufhead* worstfit(int size)
 {
-  bufhead *front, *rear, *temp;
-  void *reartobuf, *buftofront;
-  
-  rear = (bufhead*)buffer->prev;   
-  front = (bufhead*)buffer->next;
+  bufhead *buffer, *found = NULL;
 
-  if(front != NULL)
+  if(binmap == 0)
+    return NULL;
+
+  for(buffer = (bufhead*)bins[63 - __builtin_clzll(binmap)]; buffer != NULL;
+      buffer = (bufhead*)LINKS(buffer)->next)
   {
-    buftofront = (void*)((long int)buffer + sizeof(bufhead) + buffer->size);
-    if(buftofront == front)
-    {
-      buffer->size = buffer->size + sizeof(bufhead) + front->size;
-      buffer->next = front->next;
-      temp = (bufhead*)front->next;
-      if(temp != NULL)
-      	temp->prev = (void*)buffer;
-    } 
+    searched++;
+    if(found == NULL || buffer->size > found->size)
+      found = buffer;
   }
-  
-  if(rear != NULL)
+  return found->size >= size ? found : NULL;
+}
+#endif
+
+#if RM_POLICY == RM_NEXTFIT
+/* the free buffer after buffer, through the bins from first up and
+ * around again; the first one of those bins for NULL */
+static bufhead* binnext(bufhead *buffer, int first)
+{
+  unsigned long long larger;
+
+  if(buffer != NULL)
   {
-    reartobuf = (void*)((long int)rear + sizeof(bufhead) + rear->size);
-    if(reartobuf == buffer)
-    {
-      rear->size = rear->size + sizeof(bufhead) + buffer->size;
-      rear->next = buffer->next;
-      temp = (bufhead*)buffer->next;
-      if(temp != NULL)
-      	temp->prev = (void*)rear;
-    }  
-  } 
+    if(LINKS(buffer)->next != NULL)
+      return (bufhead*)LINKS(buffer)->next;
+    larger = binmap & ~((2ULL << binindex(buffer->size)) - 1);
+    if(larger != 0)
+      return (bufhead*)bins[__builtin_ctzll(larger)];
+  }
+
+  larger = binmap & ~((1ULL << first) - 1);
+  if(larger == 0)
+    return NULL;
+  return (bufhead*)bins[__builtin_ctzll(larger)];
 }
+#endif
 
-#endif // KMA_RM
+/* the free buffers looked at so far, for the driver */
+long long
+rm_searched()
+{
+  return searched;
+}
+
+void
+rm_reset()
+{
+  int i;
+
+  for(i = 0; i < NBINS; i++)
+    bins[i] = NULL;
+  binmap = 0;
+  rover = NULL;
+}
@@ -0,0 +1,524 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Malloc Library
+ * -------------------------------------------------------------------------
+ *    Purpose: Serves the malloc family of a process from one of the
+ *             kernel memory allocators, preload libkma.so to use it:
+ *               LD_PRELOAD=./libkma.so KMA_ALLOCATOR=bud app
+ *    File: kma_shim.c
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    - malloc family on the allocator table, large objects mmap'ed
+ *
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/* settings, from the environment:
+ *  KMA_ALLOCATOR       the allocator of the allocator table to use,
+ *                      bud by default
+ *  KMA_MMAP_THRESHOLD  requests of at least this many bytes are mapped
+ *                      on their own instead of going to the allocator
+ *  KMA_STATS           if set, the counters and the peak resident set
+ *                      are printed to stderr when the process exits */
+#define DEFAULT_ALLOCATOR "bud"
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+
+/* the library is built with hidden visibility, only the malloc family
+ * is exported; the error() of kpage.c and the allocators stays inside */
+#define EXPORT __attribute__((visibility("default")))
+
+/* what malloc() promises to align to */
+#define ALIGNMENT 16
+
+/* every buffer is preceded by a header with the block it was carved
+ * from; the top bit of the size marks blocks mapped on their own */
+typedef struct
+{
+  void* base;
+  size_t size;
+} header_t;
+
+#define HEADER sizeof(header_t)
+#define MAPPED ((size_t) 1 << (sizeof(size_t) * CHAR_BIT - 1))
+
+/************Global Variables*********************************************/
+
+static pthread_mutex_t gLock = PTHREAD_MUTEX_INITIALIZER;
+static int gInit = FALSE;
+
+static kma_alloc_t* gAlloc = NULL;
+static size_t gThreshold = DEFAULT_MMAP_THRESHOLD;
+/* the allocators give no alignment guarantee; the slack to align their
+ * blocks is only reserved once one of them came back misaligned */
+static size_t gSlack = 0;
+static int gStats = FALSE;
+
+static unsigned long gMallocs = 0;
+static unsigned long gFrees = 0;
+static unsigned long gMapped = 0;
+
+/************Function Prototypes******************************************/
+void init();
+void* allocate(size_t, size_t);
+void* allocateMapped(size_t, size_t);
+void deallocate(void*);
+size_t usable(void*);
+void lockAlloc();
+void unlockAlloc();
+void forkPrepare();
+void forkParent();
+void forkChild();
+long peakResident();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+EXPORT void*
+malloc(size_t size)
+{
+  return allocate(size, ALIGNMENT);
+}
+
+EXPORT void
+free(void* ptr)
+{
+  deallocate(ptr);
+}
+
+EXPORT void*
+calloc(size_t count, size_t size)
+{
+  void* ptr;
+  size_t total;
+
+  if (__builtin_mul_overflow(count, size, &total))
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  ptr = allocate(total, ALIGNMENT);
+  // fresh mappings are zeroed already
+  if (ptr != NULL && !(((header_t*) ptr - 1)->size & MAPPED))
+    {
+      memset(ptr, 0, total);
+    }
+  return ptr;
+}
+
+EXPORT void*
+realloc(void* ptr, size_t size)
+{
+  void* res;
+  size_t old;
+
+  if (ptr == NULL)
+    {
+      return allocate(size, ALIGNMENT);
+    }
+  if (size == 0)
+    {
+      deallocate(ptr);
+      return NULL;
+    }
+
+  // shrinking, or growing into the slack, keeps the buffer
+  old = usable(ptr);
+  if (size <= old)
+    {
+      return ptr;
+    }
+
+  res = allocate(size, ALIGNMENT);
+  if (res != NULL)
+    {
+      memcpy(res, ptr, old);
+      deallocate(ptr);
+    }
+  return res;
+}
+
+EXPORT int
+posix_memalign(void** res, size_t alignment, size_t size)
+{
+  if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0)
+    {
+      return EINVAL;
+    }
+
+  *res = allocate(size, alignment);
+  return *res == NULL ? ENOMEM : 0;
+}
+
+EXPORT void*
+aligned_alloc(size_t alignment, size_t size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  return allocate(size, alignment);
+}
+
+// like glibc, small alignments are plain malloc alignment and one that
+// is no power of two is rounded up to the next one
+EXPORT void*
+memalign(size_t alignment, size_t size)
+{
+  if (alignment <= ALIGNMENT)
+    {
+      return allocate(size, ALIGNMENT);
+    }
+  if (alignment > SIZE_MAX / 2 + 1)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  if ((alignment & (alignment - 1)) != 0)
+    {
+      alignment = (size_t) 1 << (sizeof(size_t) * CHAR_BIT
+				 - __builtin_clzl(alignment));
+    }
+
+  return allocate(size, alignment);
+}
+
+EXPORT void*
+valloc(size_t size)
+{
+  return allocate(size, sysconf(_SC_PAGESIZE));
+}
+
+EXPORT size_t
+malloc_usable_size(void* ptr)
+{
+  return ptr == NULL ? 0 : usable(ptr);
+}
+
+__attribute__((constructor)) void
+start()
+{
+  init();
+  pthread_atfork(forkPrepare, forkParent, forkChild);
+}
+
+__attribute__((destructor)) void
+stop()
+{
+  char line[256];
+  int length;
+
+  if (!gStats)
+    {
+      return;
+    }
+
+  // stdio may allocate, the line is formatted on the stack
+  length = snprintf(line, sizeof(line),
+		    "kma: %s, %lu mallocs, %lu frees, %lu mapped, "
+		    "%d pages in use, peak resident %ld kB\n",
+		    gAlloc->name, gMallocs, gFrees, gMapped,
+		    pages_in_use(), peakResident());
+  if (length > 0 && write(STDERR_FILENO, line, length) < 0)
+    {
+      return;
+    }
+}
+
+void
+init()
+{
+  kma_alloc_t* alloc;
+  char* name;
+  char* threshold;
+
+  pthread_mutex_lock(&gLock);
+  if (gInit)
+    {
+      pthread_mutex_unlock(&gLock);
+      return;
+    }
+
+  name = getenv("KMA_ALLOCATOR");
+  if (name == NULL)
+    {
+      name = DEFAULT_ALLOCATOR;
+    }
+
+  gAlloc = &kma_allocators[0];
+  for (alloc = kma_allocators; alloc->name != NULL; alloc++)
+    {
+      if (strcmp(alloc->name, name) == 0)
+	{
+	  gAlloc = alloc;
+	}
+    }
+
+  threshold = getenv("KMA_MMAP_THRESHOLD");
+  if (threshold != NULL)
+    {
+      gThreshold = strtoul(threshold, NULL, 0);
+    }
+  // kma_size_t is an int, and the pool maps chunks of MAXPAGES pages
+  if (gThreshold == 0 || gThreshold > (size_t) (MAXPAGES - 1) * PAGESIZE)
+    {
+      gThreshold = (size_t) (MAXPAGES - 1) * PAGESIZE;
+    }
+
+  gStats = getenv("KMA_STATS") != NULL;
+
+  // posix_memalign() behind the pool would come back here
+  set_page_backend(KPAGE_MMAP);
+
+  __atomic_store_n(&gInit, TRUE, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&gLock);
+}
+
+void*
+allocate(size_t size, size_t alignment)
+{
+  header_t* hdr;
+  char* base;
+  char* ptr;
+  size_t slack, total;
+
+  if (!__atomic_load_n(&gInit, __ATOMIC_ACQUIRE))
+    {
+      init();
+    }
+
+  if (alignment < ALIGNMENT)
+    {
+      alignment = ALIGNMENT;
+    }
+
+  for (;;)
+    {
+      slack = alignment > ALIGNMENT ? alignment - 1
+	: __atomic_load_n(&gSlack, __ATOMIC_RELAXED);
+      if (size >= gThreshold || size + HEADER + slack >= gThreshold)
+	{
+	  return allocateMapped(size, alignment);
+	}
+      total = size + HEADER + slack;
+
+      lockAlloc();
+      base = gAlloc->malloc(total);
+      unlockAlloc();
+      if (base == NULL)
+	{
+	  return allocateMapped(size, alignment);
+	}
+
+      ptr = (char*) (((uintptr_t) base + HEADER + alignment - 1)
+		     & ~(uintptr_t) (alignment - 1));
+      if (ptr + size <= base + total)
+	{
+	  break;
+	}
+
+      // the allocator does not align its blocks, reserve slack from now on
+      lockAlloc();
+      gAlloc->free(base, total);
+      unlockAlloc();
+      __atomic_store_n(&gSlack, ALIGNMENT - 1, __ATOMIC_RELAXED);
+    }
+
+  hdr = (header_t*) ptr - 1;
+  hdr->base = base;
+  hdr->size = total;
+
+  if (gStats)
+    {
+      __atomic_add_fetch(&gMallocs, 1, __ATOMIC_RELAXED);
+    }
+
+  return ptr;
+}
+
+void*
+allocateMapped(size_t size, size_t alignment)
+{
+  header_t* hdr;
+  char* base;
+  char* ptr;
+  // mappings are aligned to the system page already, the header takes
+  // up to alignment bytes in front of the buffer
+  size_t slack = alignment > (size_t) sysconf(_SC_PAGESIZE) ? alignment - 1 : 0;
+  size_t total = size + alignment + slack;
+
+  if (total < size || (total & MAPPED))
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  base = mmap(NULL, total, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  ptr = (char*) (((uintptr_t) base + HEADER + alignment - 1)
+		 & ~(uintptr_t) (alignment - 1));
+  hdr = (header_t*) ptr - 1;
+  hdr->base = base;
+  hdr->size = total | MAPPED;
+
+  if (gStats)
+    {
+      __atomic_add_fetch(&gMallocs, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&gMapped, 1, __ATOMIC_RELAXED);
+    }
+
+  return ptr;
+}
+
+void
+deallocate(void* ptr)
+{
+  header_t* hdr;
+
+  if (ptr == NULL)
+    {
+      return;
+    }
+
+  hdr = (header_t*) ptr - 1;
+  if (hdr->size & MAPPED)
+    {
+      munmap(hdr->base, hdr->size & ~MAPPED);
+    }
+  else
+    {
+      lockAlloc();
+      gAlloc->free(hdr->base, hdr->size);
+      unlockAlloc();
+    }
+
+  if (gStats)
+    {
+      __atomic_add_fetch(&gFrees, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// the bytes between the pointer and the end of its block
+size_t
+usable(void* ptr)
+{
+  header_t* hdr = (header_t*) ptr - 1;
+
+  return (char*) hdr->base + (hdr->size & ~MAPPED) - (char*) ptr;
+}
+
+// calls into allocators that are not thread safe are serialized, as
+// the driver does
+void
+lockAlloc()
+{
+  if (gAlloc == NULL || !gAlloc->threadsafe)
+    {
+      pthread_mutex_lock(&gLock);
+    }
+}
+
+void
+unlockAlloc()
+{
+  if (gAlloc == NULL || !gAlloc->threadsafe)
+    {
+      pthread_mutex_unlock(&gLock);
+    }
+}
+
+// no other thread may hold a lock of the library or the page pool
+// while forking, thread safe allocators included, so the child finds
+// them all free
+void
+forkPrepare()
+{
+  pthread_mutex_lock(&gLock);
+  page_fork_prepare();
+}
+
+void
+forkParent()
+{
+  page_fork_parent();
+  pthread_mutex_unlock(&gLock);
+}
+
+// the child only has the forking thread, whatever held the locks in
+// the parent is gone
+void
+forkChild()
+{
+  page_fork_child();
+  pthread_mutex_init(&gLock, NULL);
+}
+
+// VmHWM of /proc/self/status, in kB
+long
+peakResident()
+{
+  char status[4096];
+  char* line;
+  ssize_t length;
+  int fd = open("/proc/self/status", O_RDONLY);
+
+  if (fd < 0)
+    {
+      return -1;
+    }
+  length = read(fd, status, sizeof(status) - 1);
+  close(fd);
+  if (length <= 0)
+    {
+      return -1;
+    }
+  status[length] = '\0';
+
+  line = strstr(status, "VmHWM:");
+  return line == NULL ? -1 : strtol(line + strlen("VmHWM:"), NULL, 10);
+}
+
+void
+error(char* message, char* arg)
+{
+  char line[256];
+  int length = snprintf(line, sizeof(line), "ERROR: %s: %s.\n", message, arg);
+
+  if (length > 0 && write(STDERR_FILENO, line, length) < 0)
+    {
+      abort();
+    }
+  abort();
+}
@@ -0,0 +1,46 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Table
+ * -------------------------------------------------------------------------
+ *    Purpose: The allocators the driver and the malloc library choose from
+ *    File: kma_table.c
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    - moved out of the driver for the malloc library
+ *
+ ***************************************************************************/
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <stdlib.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+kma_alloc_t kma_allocators[] =
+  {
+    { "dummy", dummy_malloc, dummy_free, dummy_reset, TRUE,  NULL        },
+    { "rm",    rm_malloc,    rm_free,    rm_reset,    FALSE, rm_searched },
+    { "p2fl",  p2fl_malloc,  p2fl_free,  p2fl_reset,  FALSE, NULL        },
+    { "mck2",  mck2_malloc,  mck2_free,  mck2_reset,  FALSE, NULL        },
+    { "bud",   bud_malloc,   bud_free,   bud_reset,   FALSE, NULL        },
+    { "lzbud", lzbud_malloc, lzbud_free, lzbud_reset, FALSE, NULL        },
+    { NULL }
+  };
+
+/************Function Prototypes******************************************/
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
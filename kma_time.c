@@ -0,0 +1,109 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Timer
+ * -------------------------------------------------------------------------
+ *    Purpose: Runs a command and reports its wall time and peak
+ *             resident set, to compare the malloc library with the
+ *             system malloc
+ *    File: kma_time.c
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    - wall time and maximum resident set of a command
+ *
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+double seconds();
+void usage();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+char *name = NULL;
+
+int
+main(int argc, char* argv[])
+{
+  struct rusage rusage;
+  double start, wall;
+  int status;
+  pid_t pid;
+
+  name = argv[0];
+
+  if (argc < 2)
+    {
+      usage();
+    }
+
+  start = seconds();
+  pid = fork();
+  if (pid < 0)
+    {
+      error("unable to fork", argv[1]);
+    }
+  if (pid == 0)
+    {
+      execvp(argv[1], argv + 1);
+      error("unable to run", argv[1]);
+    }
+
+  if (wait4(pid, &status, 0, &rusage) != pid)
+    {
+      error("unable to wait for", argv[1]);
+    }
+  wall = seconds() - start;
+
+  fprintf(stderr, "%s: %.3f s wall, %.3f s user, %.3f s system, "
+	  "%ld kB maximum resident\n", argv[1], wall,
+	  rusage.ru_utime.tv_sec + rusage.ru_utime.tv_usec / 1e6,
+	  rusage.ru_stime.tv_sec + rusage.ru_stime.tv_usec / 1e6,
+	  rusage.ru_maxrss);
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+double
+seconds()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+usage()
+{
+  printf("Usage: %s command [argument ...]\n", name);
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
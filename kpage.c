@@ -49,6 +49,9 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 /************Private include**********************************************/
 #include "kpage.h"
@@ -61,16 +64,150 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* largest buddy order kept on the free lists; 2^MAXORDER bounds MAXPAGES */
+#define MAXORDER 20
+
+/* bytes per pool chunk; chunks are aligned to their size */
+#define CHUNKSIZE ((long)MAXPAGES * PAGESIZE)
+
+/* bytes of a chunk's descriptor table */
+#define CHUNKMETASIZE (sizeof(kchunk_t) + MAXPAGES * sizeof(kpage_desc_t))
+
+/* slots of the chunk directory hash table, a power of two */
+#define CHUNKSLOTS (2 * MAXCHUNKS)
+
+/* top of the page stack while it is closed, see flushStack() */
+#define STACK_CLOSED 0xffffffffU
+
+/* page descriptor, one per page of the pool */
+typedef struct kpage_desc
+{
+  kpage_t page;             /* the part handed out to the allocators */
+  struct kpage_desc* next;  /* free list links, valid for free blocks */
+  struct kpage_desc* prev;
+  signed char order;        /* order of the free block starting here, -1 if none */
+  bool dirty;               /* free, but still holding memory */
+  short chunk;              /* index of the chunk holding the page */
+  struct kpage_desc* dnext; /* dirty list links, oldest free page first */
+  struct kpage_desc* dprev;
+  unsigned int snext;       /* page stack link, see page_stack */
+} kpage_desc_t;
+
+/* per-thread cache of free single pages, most recently freed last */
+typedef struct
+{
+  int count;
+  bool registered;                        /* flushed on thread exit */
+  kpage_desc_t* pages[KPAGE_CACHE_LIMIT + 1]; /* one over before a batch goes */
+} kcache_t;
+
+/* pool chunk: MAXPAGES pages and their descriptors */
+typedef struct
+{
+  void* base;                   /* first page of the chunk */
+  int bump;                     /* pages from here on were never handed out */
+  kpage_desc_t desc[];          /* indexed by (ptr - base) >> PAGESHIFT */
+} kchunk_t;
+
 /************Global Variables*********************************************/
-static kpage_stat_t kpage_stats = { 0, 0, 0, PAGESIZE };
+/* everything but the page stack and the page counters of kpage_stats
+ * is guarded by pool_lock */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* lock-free (Treiber) stack of free single pages in front of the buddy
+ * system; the low half of the head is the pool index + 1 of the top
+ * page (0 if empty), the high half a tag bumped on every update so a
+ * head that was popped and pushed again never compares equal (ABA) */
+static unsigned long long page_stack = 0;
+static int num_stacked = 0;
+static int stack_limit = KPAGE_STACK_LIMIT;
+
+/* pages out of the pool, in use or in a page cache; raised before a
+ * page is taken and lowered only after it is back, so a drain sees
+ * every page that is still around */
+static int num_taken = 0;
 
-static void* pool = NULL;
-static void* next_free_page = NULL;
+/* page caches, see set_page_cache() */
+static __thread kcache_t page_cache;
+static int cache_limit = KPAGE_CACHE_LIMIT;
+static int cache_batch = KPAGE_CACHE_BATCH;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+int gPageSize = KPAGE_PAGESIZE;
+int gPageShift = __builtin_ctz(KPAGE_PAGESIZE);
+int gMaxPages = KPAGE_MAXPAGES;
+
+static kpage_stat_t kpage_stats = { 0, 0, 0, KPAGE_PAGESIZE, 0, 0, 0, 0 };
+
+static int backend = KPAGE_BACKEND;
+static int pool_backend;
+static int startup = KPAGE_STARTUP;
+static int hugepages = KPAGE_HUGEPAGES;
+
+/* log2 of CHUNKSIZE, keys the chunk directory */
+static int chunk_shift = __builtin_ctz(KPAGE_PAGESIZE)
+                         + __builtin_ctz(KPAGE_MAXPAGES);
+
+/* chunks in the order they were mapped; only the last one still has
+ * never used pages behind its bump pointer */
+static kchunk_t* chunks[MAXCHUNKS];
+static int num_chunks = 0;
+
+/* chunk directory, open addressing on the chunk number of an address */
+static kchunk_t* chunk_dir[CHUNKSLOTS];
+
+/* pool retention, see set_page_retention() */
+static int retention = KPAGE_RETENTION;
+static long long idle_threshold = KPAGE_IDLE_THRESHOLD;
+
+/* when the pool last drained, and how long it stayed drained back then */
+static bool drained = FALSE;
+static long long drained_at = 0;
+static long long last_idle = -1;
+
+/* free lists of the page buddy system, one per order, across chunks */
+static kpage_desc_t* free_area[MAXORDER + 1];
+
+/* free pages that still hold memory, in the order they were freed */
+static kpage_desc_t* dirty_head = NULL;
+static kpage_desc_t* dirty_tail = NULL;
+static int num_dirty = 0;
+
+/* page release watermarks, see set_page_release() */
+static int release_high = KPAGE_RELEASE_HIGH;
+static int release_low = KPAGE_RELEASE_LOW;
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
-void initPages();
+kpage_desc_t* allocPages(int);
+kpage_desc_t* allocFree(int);
+kpage_desc_t* allocBump(int);
+void freePages(kpage_desc_t*, int);
+void putPages(kpage_desc_t*, int);
+int takePages(kpage_desc_t**, int);
+void givePages(kpage_desc_t**, int);
+void settlePool();
+kpage_desc_t* cacheGet();
+void cachePut(kpage_desc_t*);
+void cacheFlush(void*);
+void cacheKey();
+kpage_desc_t* popPage();
+bool pushPage(kpage_desc_t*);
+void flushStack();
+void openStack();
+kpage_desc_t* stackDesc(unsigned int);
+kchunk_t* findChunk(void*);
+bool addChunk();
+void* mapChunk();
+void unmapPool();
+void drainPages();
+void releasePages(int);
+void cleanPage(kpage_desc_t*);
+void* pageAddr(kpage_desc_t*);
+long long now();
+void freeRange(kchunk_t*, int, int);
+void freeBlock(kchunk_t*, int, int);
+void removeBlock(kpage_desc_t*, int);
 
 /************External Declaration*****************************************/
 
@@ -78,35 +215,201 @@ void initPages();
 
 kpage_t*
 get_page()
+{
+  kpage_t* res = get_pages(1);
+  
+  if (res == NULL)
+    {
+      error("error: all pages already allocated", "");
+    }
+  
+  return res;
+}
+
+void
+free_page(kpage_t* ptr)
+{
+  free_pages(ptr);
+}
+
+kpage_t*
+get_pages(int npages)
 {
   static int id = 0;
+  kpage_desc_t* desc;
   kpage_t* res;
+  int i;
+  
+  assert(npages > 0);
   
-  kpage_stats.num_requested++;
-  kpage_stats.num_in_use++;
+  if (npages == 1)
+    {
+      desc = cacheGet();
+      if (desc == NULL && takePages(&desc, 1) == 0)
+	{
+	  return NULL;
+	}
+    }
+  else
+    {
+      __atomic_add_fetch(&num_taken, npages, __ATOMIC_SEQ_CST);
+      pthread_mutex_lock(&pool_lock);
+      desc = allocPages(npages);
+      if (desc == NULL)
+	{
+	  pthread_mutex_unlock(&pool_lock);
+	  __atomic_sub_fetch(&num_taken, npages, __ATOMIC_SEQ_CST);
+	  return NULL;
+	}
+      
+      // pages coming back from the free lists may still hold memory
+      for (i = 0; i < npages; i++)
+	{
+	  if (desc[i].dirty)
+	    {
+	      cleanPage(&desc[i]);
+	    }
+	}
+      pthread_mutex_unlock(&pool_lock);
+    }
   
-  res = (kpage_t*) malloc(sizeof(kpage_t));
-  res->id = id++;
-  res->size = kpage_stats.page_size;
-  res->ptr = allocPage();
+  __atomic_add_fetch(&kpage_stats.num_requested, npages, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&kpage_stats.num_in_use, npages, __ATOMIC_RELAXED);
   
-  assert(res->ptr != NULL);
+  res = &desc->page;
+  res->id = __atomic_fetch_add(&id, 1, __ATOMIC_RELAXED);
+  res->size = npages * kpage_stats.page_size;
+  res->ptr = pageAddr(desc);
   
-  return res;	
+  return res;
 }
 
 void
-free_page(kpage_t* ptr)
+free_pages(kpage_t* ptr)
 {
+  int npages;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kpage_stats.num_in_use > 0);
+  assert(ptr == lookup_page(ptr->ptr));
+  
+  npages = ptr->size >> PAGESHIFT;
+  assert(__atomic_load_n(&kpage_stats.num_in_use, __ATOMIC_RELAXED) >= npages);
+  
+  __atomic_add_fetch(&kpage_stats.num_freed, npages, __ATOMIC_RELAXED);
+  
+  ptr->ptr = NULL;
+  if (npages == 1 && cache_limit > 0)
+    {
+      cachePut((kpage_desc_t*)ptr);
+    }
+  else
+    {
+      freePages((kpage_desc_t*)ptr, npages);
+    }
+  
+  // the last page is back, the pool may drain if no other thread
+  // caches pages
+  if (__atomic_sub_fetch(&kpage_stats.num_in_use, npages, __ATOMIC_RELAXED) == 0)
+    {
+      cacheFlush(&page_cache);
+    }
+}
+
+kpage_t*
+lookup_page(void* ptr)
+{
+  kchunk_t* chunk = findChunk(ptr);
+  
+  assert(chunk != NULL);
+  
+  return &chunk->desc[(ptr - chunk->base) >> PAGESHIFT].page;
+}
+
+int
+page_in_pool(void* ptr)
+{
+  return findChunk(ptr) != NULL;
+}
+
+void
+set_page_retention(int policy, int threshold)
+{
+  assert(policy == KPAGE_RETAIN || policy == KPAGE_MADVISE
+	 || policy == KPAGE_TEARDOWN);
+  
+  retention = policy;
+  idle_threshold = threshold;
+}
+
+void
+set_page_release(int high, int low)
+{
+  assert(high >= 0 && low >= 0 && (high == 0 || low <= high));
+  
+  release_high = high;
+  release_low = low;
+}
+
+void
+set_page_hugepages(int enable)
+{
+  hugepages = enable;
+}
+
+void
+set_page_backend(int type)
+{
+  assert(type == KPAGE_MEMALIGN || type == KPAGE_MMAP);
+  
+  backend = type;
+}
+
+void
+set_page_startup(int type)
+{
+  assert(type == KPAGE_LAZY || type == KPAGE_EAGER);
+  
+  startup = type;
+}
+
+int
+set_page_size(int pagesize, int maxpages)
+{
+  if (num_chunks > 0
+      || pagesize < MINPAGESIZE || pagesize > MAXPAGESIZE
+      || (pagesize & (pagesize - 1)) != 0
+      || maxpages < 1 || maxpages > (1 << MAXORDER)
+      || (maxpages & (maxpages - 1)) != 0)
+    {
+      return FALSE;
+    }
+  
+  gPageSize = pagesize;
+  gPageShift = ffs(pagesize) - 1;
+  gMaxPages = maxpages;
+  chunk_shift = gPageShift + ffs(maxpages) - 1;
+  kpage_stats.page_size = pagesize;
+  
+  return TRUE;
+}
+
+void
+set_page_cache(int limit, int batch)
+{
+  assert(limit >= 0 && limit <= KPAGE_CACHE_LIMIT);
+  assert(limit == 0 || (batch > 0 && batch <= limit));
   
-  kpage_stats.num_freed++;
-  kpage_stats.num_in_use--;
+  cache_limit = limit;
+  cache_batch = batch;
+}
+
+void
+set_page_stack(int limit)
+{
+  assert(limit >= 0);
   
-  freePage(ptr->ptr);
-  free(ptr);
+  stack_limit = limit;
 }
 
 kpage_stat_t*
@@ -114,71 +417,856 @@ page_stats()
 {
   static kpage_stat_t stats;
   
-  return memcpy(&stats, &kpage_stats, sizeof(kpage_stat_t));
+  pthread_mutex_lock(&pool_lock);
+  memcpy(&stats, &kpage_stats, sizeof(kpage_stat_t));
+  stats.num_resident = __atomic_load_n(&num_taken, __ATOMIC_RELAXED)
+    + num_dirty + __atomic_load_n(&num_stacked, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&pool_lock);
+  
+  return &stats;
 }
 
-void*
-allocPage()
+int
+pages_in_use()
+{
+  return __atomic_load_n(&kpage_stats.num_in_use, __ATOMIC_RELAXED);
+}
+
+int
+reset_pages()
 {
-  void* res;
+  int reset = FALSE;
+  
+  cacheFlush(&page_cache);
   
-  if (pool == NULL)
+  pthread_mutex_lock(&pool_lock);
+  // as in settlePool(), only a closed stack proves no page is out
+  if (__atomic_load_n(&num_taken, __ATOMIC_SEQ_CST) == 0)
     {
-      initPages();
+      flushStack();
+      if (__atomic_load_n(&num_taken, __ATOMIC_SEQ_CST) == 0)
+	{
+	  unmapPool();
+	  drained = FALSE;
+	  last_idle = -1;
+	  reset = TRUE;
+	}
+      openStack();
     }
+  pthread_mutex_unlock(&pool_lock);
   
-  res = next_free_page;
+  return reset;
+}
+
+void
+page_fork_prepare()
+{
+  pthread_mutex_lock(&pool_lock);
+}
+
+void
+page_fork_parent()
+{
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// the pages in the caches of the other threads are lost to the child
+void
+page_fork_child()
+{
+  pthread_mutex_init(&pool_lock, NULL);
+}
+
+kpage_desc_t*
+allocPages(int npages)
+{
+  kpage_desc_t* desc;
+  kchunk_t* last;
   
-  if (res == NULL)
+  if (drained)
     {
-      error("error: all pages already allocated", "");
+      last_idle = now() - drained_at;
+      drained = FALSE;
     }
   
-  next_free_page = *((void**)next_free_page);
+  // runs never span chunks
+  if (npages > MAXPAGES)
+    {
+      return NULL;
+    }
   
-  assert(res != NULL);
+  desc = allocFree(npages);
+  if (desc != NULL)
+    {
+      return desc;
+    }
   
-  return res;
+  desc = allocBump(npages);
+  if (desc != NULL)
+    {
+      return desc;
+    }
+  
+  // the newest chunk is too full, retire its never used pages to the
+  // free lists, where they may coalesce into a large enough block
+  if (num_chunks > 0)
+    {
+      last = chunks[num_chunks - 1];
+      if (last->bump < MAXPAGES)
+	{
+	  desc = allocBump(MAXPAGES - last->bump);
+	  freeRange(last, desc - last->desc, MAXPAGES - (desc - last->desc));
+	  
+	  desc = allocFree(npages);
+	  if (desc != NULL)
+	    {
+	      return desc;
+	    }
+	}
+    }
+  
+  // the stacked pages may coalesce into a large enough block
+  if (__atomic_load_n(&num_stacked, __ATOMIC_RELAXED) > 0)
+    {
+      flushStack();
+      openStack();
+      desc = allocFree(npages);
+      if (desc != NULL)
+	{
+	  return desc;
+	}
+    }
+  
+  // grow the pool
+  if (!addChunk())
+    {
+      return NULL;
+    }
+  
+  // an eager chunk has nothing behind its bump pointer
+  desc = allocBump(npages);
+  return desc != NULL ? desc : allocFree(npages);
+}
+
+// take a run from the buddy free lists
+kpage_desc_t*
+allocFree(int npages)
+{
+  kpage_desc_t* desc;
+  kchunk_t* chunk;
+  int order, i, index;
+  
+  // smallest block that holds the run
+  for (order = 0; (1 << order) < npages; order++)
+    ;
+  
+  // smallest free block that holds the block
+  for (i = order; i <= MAXORDER && free_area[i] == NULL; i++)
+    ;
+  
+  if (i > MAXORDER)
+    {
+      return NULL;
+    }
+  
+  desc = free_area[i];
+  chunk = chunks[desc->chunk];
+  index = desc - chunk->desc;
+  removeBlock(desc, i);
+  
+  // split the block, giving the upper halves back
+  while (i > order)
+    {
+      i--;
+      freeBlock(chunk, index + (1 << i), i);
+    }
+  
+  // give back the pages past the end of the run
+  freeRange(chunk, index + npages, (1 << order) - npages);
+  
+  return desc;
+}
+
+// take a run of never used pages from the newest chunk
+kpage_desc_t*
+allocBump(int npages)
+{
+  kchunk_t* chunk;
+  int i, index;
+  
+  if (num_chunks == 0)
+    {
+      return NULL;
+    }
+  
+  chunk = chunks[num_chunks - 1];
+  if (chunk->bump + npages > MAXPAGES)
+    {
+      return NULL;
+    }
+  
+  index = chunk->bump;
+  chunk->bump += npages;
+  for (i = index; i < chunk->bump; i++)
+    {
+      chunk->desc[i].order = -1;
+      chunk->desc[i].dirty = FALSE;
+      chunk->desc[i].chunk = num_chunks - 1;
+    }
+  
+  return &chunk->desc[index];
 }
 
 void
-freePage(void* ptr)
+freePages(kpage_desc_t* desc, int npages)
 {
-  assert(ptr != NULL);
+  if (npages == 1)
+    {
+      givePages(&desc, 1);
+      return;
+    }
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  pthread_mutex_lock(&pool_lock);
+  putPages(desc, npages);
+  __atomic_sub_fetch(&num_taken, npages, __ATOMIC_SEQ_CST);
+  settlePool();
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// take up to n single pages out of the pool, from the page stack
+// first and then from the buddy system under one lock
+int
+takePages(kpage_desc_t** pages, int n)
+{
+  int i;
+  
+  // count the pages before taking them, see num_taken
+  __atomic_add_fetch(&num_taken, n, __ATOMIC_SEQ_CST);
   
-  if (kpage_stats.num_in_use == 0)
+  for (i = 0; i < n && (pages[i] = popPage()) != NULL; i++)
+    ;
+  
+  if (i < n)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      pthread_mutex_lock(&pool_lock);
+      for (; i < n && (pages[i] = allocPages(1)) != NULL; i++)
+	{
+	  // pages coming back from the free lists may still hold memory
+	  if (pages[i]->dirty)
+	    {
+	      cleanPage(pages[i]);
+	    }
+	}
+      pthread_mutex_unlock(&pool_lock);
     }
+  
+  if (i < n)
+    {
+      __atomic_sub_fetch(&num_taken, n - i, __ATOMIC_SEQ_CST);
+    }
+  
+  return i;
 }
 
+// give single pages back to the pool, to the page stack first and
+// the rest to the buddy system under one lock
 void
-initPages()
+givePages(kpage_desc_t** pages, int n)
 {
   int i;
   
-  assert(next_free_page == NULL);
-  assert(pool == NULL);
+  for (i = 0; i < n && pushPage(pages[i]); i++)
+    ;
+  
+  if (i < n)
+    {
+      pthread_mutex_lock(&pool_lock);
+      for (; i < n; i++)
+	{
+	  putPages(pages[i], 1);
+	}
+      __atomic_sub_fetch(&num_taken, n, __ATOMIC_SEQ_CST);
+      settlePool();
+      pthread_mutex_unlock(&pool_lock);
+      return;
+    }
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  // the pool only needs the lock once the last page is back
+  if (__atomic_sub_fetch(&num_taken, n, __ATOMIC_SEQ_CST) > 0
+      || retention == KPAGE_RETAIN)
+    {
+      return;
+    }
+  pthread_mutex_lock(&pool_lock);
+  settlePool();
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// apply the retention policy or the release watermarks after pages
+// came back; called with the lock held
+void
+settlePool()
+{
+  // once the stack is closed no page can be out without num_taken
+  // showing it
+  if (__atomic_load_n(&num_taken, __ATOMIC_SEQ_CST) == 0)
+    {
+      flushStack();
+      if (__atomic_load_n(&num_taken, __ATOMIC_SEQ_CST) == 0)
+	{
+	  drainPages();
+	}
+      openStack();
+    }
+  else if (release_high > 0 && num_dirty > release_high)
+    {
+      releasePages(release_low);
+    }
+}
+
+// a single page from the page cache of the thread, refilled in a batch
+// when it is empty; NULL if the cache is off or the pool is exhausted
+kpage_desc_t*
+cacheGet()
+{
+  kcache_t* cache = &page_cache;
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  if (cache_limit == 0)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      return NULL;
+    }
+  
+  if (cache->count == 0)
+    {
+      if (!cache->registered)
+	{
+	  pthread_once(&cache_once, cacheKey);
+	  pthread_setspecific(cache_key, cache);
+	  cache->registered = TRUE;
+	}
+      cache->count = takePages(cache->pages, cache_batch);
+      if (cache->count == 0)
+	{
+	  return NULL;
+	}
+    }
+  
+  return cache->pages[--cache->count];
+}
+
+// put a single page into the page cache of the thread, giving the
+// oldest pages back in a batch when it is over its limit
+void
+cachePut(kpage_desc_t* desc)
+{
+  kcache_t* cache = &page_cache;
+  int n;
+  
+  cache->pages[cache->count++] = desc;
+  if (cache->count <= cache_limit)
+    {
+      return;
+    }
+  
+  n = cache->count - cache_limit;
+  if (n < cache_batch)
+    {
+      n = cache_batch;
+    }
+  givePages(cache->pages, n);
+  cache->count -= n;
+  memmove(cache->pages, cache->pages + n, cache->count * sizeof(kpage_desc_t*));
+}
+
+// give every page of a page cache back; also the destructor of the
+// cache key, so exiting threads strand no pages
+void
+cacheFlush(void* ptr)
+{
+  kcache_t* cache = ptr;
+  
+  if (cache->count > 0)
+    {
+      givePages(cache->pages, cache->count);
+      cache->count = 0;
+    }
+}
+
+void
+cacheKey()
+{
+  pthread_key_create(&cache_key, cacheFlush);
+}
+
+// hand pages back to the buddy system
+void
+putPages(kpage_desc_t* desc, int npages)
+{
+  kchunk_t* chunk = chunks[desc->chunk];
+  int index = desc - chunk->desc;
+  int i;
+  
+  assert(index >= 0 && index + npages <= chunk->bump);
+  
+  // the pages keep their memory until they are released
+  for (i = 0; i < npages; i++)
+    {
+      desc[i].dirty = TRUE;
+      desc[i].dnext = NULL;
+      desc[i].dprev = dirty_tail;
+      if (dirty_tail != NULL)
+	{
+	  dirty_tail->dnext = &desc[i];
+	}
+      else
+	{
+	  dirty_head = &desc[i];
+	}
+      dirty_tail = &desc[i];
+    }
+  num_dirty += npages;
+  
+  freeRange(chunk, index, npages);
+}
+
+// take the top page off the page stack, NULL if it is empty or closed
+kpage_desc_t*
+popPage()
+{
+  unsigned long long head, next;
+  kpage_desc_t* desc;
+  
+  head = __atomic_load_n(&page_stack, __ATOMIC_ACQUIRE);
+  do
+    {
+      if ((unsigned int)head == 0 || (unsigned int)head == STACK_CLOSED)
+	{
+	  return NULL;
+	}
+      // the page may be popped by someone else meanwhile, then its
+      // link is stale but the tag makes the exchange fail
+      desc = stackDesc((unsigned int)head);
+      next = (head >> 32) + 1;
+      next = next << 32 | __atomic_load_n(&desc->snext, __ATOMIC_RELAXED);
+    }
+  while (!__atomic_compare_exchange_n(&page_stack, &head, next, TRUE,
+				      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  
+  __atomic_sub_fetch(&num_stacked, 1, __ATOMIC_RELAXED);
+  return desc;
+}
+
+// put a single page on the page stack, FALSE if it is full or closed
+bool
+pushPage(kpage_desc_t* desc)
+{
+  kchunk_t* chunk = chunks[desc->chunk];
+  unsigned int top = desc->chunk * MAXPAGES + (desc - chunk->desc) + 1;
+  unsigned long long head, next;
+  
+  if (__atomic_load_n(&num_stacked, __ATOMIC_RELAXED) >= stack_limit)
+    {
+      return FALSE;
+    }
+  
+  head = __atomic_load_n(&page_stack, __ATOMIC_RELAXED);
+  do
+    {
+      if ((unsigned int)head == STACK_CLOSED)
+	{
+	  return FALSE;
+	}
+      __atomic_store_n(&desc->snext, (unsigned int)head, __ATOMIC_RELAXED);
+      next = (head >> 32) + 1;
+      next = next << 32 | top;
+    }
+  while (!__atomic_compare_exchange_n(&page_stack, &head, next, TRUE,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  
+  __atomic_add_fetch(&num_stacked, 1, __ATOMIC_RELAXED);
+  return TRUE;
+}
+
+// close the page stack and hand its pages to the buddy system; called
+// with the lock held, openStack() lets pages back on
+void
+flushStack()
+{
+  unsigned long long head, next;
+  unsigned int top;
+  kpage_desc_t* desc;
+  
+  head = __atomic_load_n(&page_stack, __ATOMIC_ACQUIRE);
+  do
+    {
+      next = ((head >> 32) + 1) << 32 | STACK_CLOSED;
+    }
+  while (!__atomic_compare_exchange_n(&page_stack, &head, next, TRUE,
+				      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  
+  for (top = (unsigned int)head; top != 0; top = desc->snext)
+    {
+      desc = stackDesc(top);
+      putPages(desc, 1);
+      __atomic_sub_fetch(&num_stacked, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// reopen the page stack closed by flushStack(), empty
+void
+openStack()
+{
+  unsigned long long head = __atomic_load_n(&page_stack, __ATOMIC_RELAXED);
+  
+  assert((unsigned int)head == STACK_CLOSED);
+  __atomic_store_n(&page_stack, ((head >> 32) + 1) << 32, __ATOMIC_RELEASE);
+}
+
+// descriptor of a page stack entry
+kpage_desc_t*
+stackDesc(unsigned int top)
+{
+  int maxpages_shift = chunk_shift - PAGESHIFT;
+  
+  top--;
+  return &chunks[top >> maxpages_shift]->desc[top & (MAXPAGES - 1)];
+}
+
+// return the oldest free pages to the OS until only keep of them
+// still hold memory
+void
+releasePages(int keep)
+{
+  void* start = NULL;
+  void* end = NULL;
+  void* ptr;
+  
+  while (num_dirty > keep)
+    {
+      ptr = pageAddr(dirty_head);
+      cleanPage(dirty_head);
+      kpage_stats.num_released++;
       
-      *((void**) ptr) = next;
+      // neighbouring pages go out in one call
+      if (ptr != end)
+	{
+	  if (start != NULL)
+	    {
+	      madvise(start, end - start, KPAGE_RELEASE_ADVICE);
+	    }
+	  start = ptr;
+	}
+      end = ptr + PAGESIZE;
+    }
+  
+  if (start != NULL)
+    {
+      madvise(start, end - start, KPAGE_RELEASE_ADVICE);
+    }
+}
+
+// take a page off the dirty list
+void
+cleanPage(kpage_desc_t* desc)
+{
+  assert(desc->dirty);
+  
+  if (desc->dprev != NULL)
+    {
+      desc->dprev->dnext = desc->dnext;
+    }
+  else
+    {
+      dirty_head = desc->dnext;
     }
+  if (desc->dnext != NULL)
+    {
+      desc->dnext->dprev = desc->dprev;
+    }
+  else
+    {
+      dirty_tail = desc->dprev;
+    }
+  desc->dirty = FALSE;
+  num_dirty--;
+}
+
+// address of the page a descriptor stands for
+void*
+pageAddr(kpage_desc_t* desc)
+{
+  kchunk_t* chunk = chunks[desc->chunk];
+  
+  return chunk->base + ((long)(desc - chunk->desc) << PAGESHIFT);
+}
+
+// the last page was freed, apply the retention policy
+void
+drainPages()
+{
+  int i;
+  
+  drained = TRUE;
+  drained_at = now();
+  
+  // the pool refilled quickly last time, so it probably will again
+  if (retention == KPAGE_RETAIN
+      || (last_idle >= 0 && last_idle < idle_threshold))
+    {
+      return;
+    }
+  
+  if (retention == KPAGE_MADVISE)
+    {
+      for (i = 0; i < num_chunks; i++)
+	{
+	  madvise(chunks[i]->base, CHUNKSIZE, MADV_DONTNEED);
+	}
+      kpage_stats.num_released += num_dirty;
+      while (dirty_head != NULL)
+	{
+	  cleanPage(dirty_head);
+	}
+    }
+  else
+    {
+      unmapPool();
+      drained = FALSE;
+    }
+}
+
+// find the chunk holding an address in the chunk directory
+kchunk_t*
+findChunk(void* ptr)
+{
+  unsigned long key = (unsigned long)ptr >> chunk_shift;
+  int slot = key & (CHUNKSLOTS - 1);
+  
+  while (chunk_dir[slot] != NULL)
+    {
+      if ((unsigned long)chunk_dir[slot]->base >> chunk_shift == key)
+	{
+	  return chunk_dir[slot];
+	}
+      slot = (slot + 1) & (CHUNKSLOTS - 1);
+    }
+  
+  return NULL;
+}
+
+// map another chunk and enter it in the chunk directory
+bool
+addChunk()
+{
+  kchunk_t* chunk;
+  int slot;
+  
+  if (num_chunks == MAXCHUNKS)
+    {
+      return FALSE;
+    }
+  
+  if (num_chunks == 0)
+    {
+      static bool built = FALSE;
+      
+      if (built)
+	{
+	  kpage_stats.num_rebuilds++;
+	}
+      built = TRUE;
+      pool_backend = backend;
+    }
+  
+  // the descriptors live outside the pool, but never in the heap
+  chunk = mmap(NULL, CHUNKMETASIZE, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED)
+    {
+      return FALSE;
+    }
+  
+  chunk->base = mapChunk();
+  if (chunk->base == NULL)
+    {
+      munmap(chunk, CHUNKMETASIZE);
+      return FALSE;
+    }
+  
+  // chunks are aligned to their size, so every huge page is full
+  if (hugepages)
+    {
+      madvise(chunk->base, CHUNKSIZE, MADV_HUGEPAGE);
+    }
+  
+  // lazily nothing is threaded up front, pages are taken from the bump
+  // pointer until they come back through the free lists
+  chunk->bump = 0;
+  
+  slot = ((unsigned long)chunk->base >> chunk_shift) & (CHUNKSLOTS - 1);
+  while (chunk_dir[slot] != NULL)
+    {
+      slot = (slot + 1) & (CHUNKSLOTS - 1);
+    }
+  chunk_dir[slot] = chunk;
+  chunks[num_chunks++] = chunk;
+  kpage_stats.num_chunks = num_chunks;
+  
+  // eagerly the whole chunk goes on the free lists right away
+  if (startup == KPAGE_EAGER)
+    {
+      allocBump(MAXPAGES);
+      freeRange(chunk, 0, MAXPAGES);
+    }
+  
+  return TRUE;
+}
+
+// get chunk aligned memory for the pool from the backend
+void*
+mapChunk()
+{
+  void* ptr = NULL;
+  void* aligned;
+  
+  if (pool_backend == KPAGE_MEMALIGN)
+    {
+      //ptr = calloc(MAXPAGES, PAGESIZE);
+      if (posix_memalign(&ptr, CHUNKSIZE, CHUNKSIZE))
+	{
+	  return NULL;
+	}
+      return ptr;
+    }
+  
+  // mmap only aligns to the OS page, map a chunk more and trim
+  ptr = mmap(NULL, 2 * CHUNKSIZE, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED)
+    {
+      return NULL;
+    }
+  
+  aligned = (void*)(((long)ptr + CHUNKSIZE - 1) & ~(CHUNKSIZE - 1));
+  if (aligned > ptr)
+    {
+      munmap(ptr, aligned - ptr);
+    }
+  munmap(aligned + CHUNKSIZE, ptr + CHUNKSIZE - aligned);
+  
+  return aligned;
+}
+
+// give every chunk back
+void
+unmapPool()
+{
+  int i;
+  
+  for (i = 0; i < num_chunks; i++)
+    {
+      if (pool_backend == KPAGE_MEMALIGN)
+	{
+	  free(chunks[i]->base);
+	}
+      else
+	{
+	  munmap(chunks[i]->base, CHUNKSIZE);
+	}
+      munmap(chunks[i], CHUNKMETASIZE);
+      chunks[i] = NULL;
+    }
+  
+  num_chunks = 0;
+  kpage_stats.num_chunks = 0;
+  memset(chunk_dir, 0, sizeof(chunk_dir));
+  memset(free_area, 0, sizeof(free_area));
+  dirty_head = NULL;
+  dirty_tail = NULL;
+  num_dirty = 0;
+}
+
+// split [index, index + npages) into aligned blocks and free each one
+void
+freeRange(kchunk_t* chunk, int index, int npages)
+{
+  int order;
+  
+  while (npages > 0)
+    {
+      for (order = 0; order < MAXORDER; order++)
+	{
+	  if ((index & (1 << order)) || (2 << order) > npages)
+	    {
+	      break;
+	    }
+	}
+      
+      freeBlock(chunk, index, order);
+      index += 1 << order;
+      npages -= 1 << order;
+    }
+}
+
+// put a block back on the free lists, coalescing with free buddies
+void
+freeBlock(kchunk_t* chunk, int index, int order)
+{
+  kpage_desc_t* block;
+  int buddy;
+  
+  while (order < MAXORDER)
+    {
+      buddy = index ^ (1 << order);
+      if (buddy + (1 << order) > chunk->bump
+	  || chunk->desc[buddy].order != order)
+	{
+	  break;
+	}
+      
+      removeBlock(&chunk->desc[buddy], order);
+      index &= ~(1 << order);
+      order++;
+    }
+  
+  block = &chunk->desc[index];
+  block->order = order;
+  block->prev = NULL;
+  block->next = free_area[order];
+  if (block->next != NULL)
+    {
+      block->next->prev = block;
+    }
+  free_area[order] = block;
+}
+
+// take a free block off its free list
+void
+removeBlock(kpage_desc_t* block, int order)
+{
+  assert(block->order == order);
+  
+  if (block->prev != NULL)
+    {
+      block->prev->next = block->next;
+    }
+  else
+    {
+      free_area[order] = block->next;
+    }
+  if (block->next != NULL)
+    {
+      block->next->prev = block->prev;
+    }
+  block->order = -1;
+}
+
+// monotonic time in microseconds
+long long
+now()
+{
+  struct timespec ts;
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
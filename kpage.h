@@ -66,9 +66,106 @@
 #define EXTERN extern
 #endif
 
-#define PAGESIZE 8192
+/* page sizes set_page_size() accepts; static tables are sized for
+ * the largest one */
+#define MINPAGESHIFT 12
+#define MAXPAGESHIFT 16
+#define MINPAGESIZE (1 << MINPAGESHIFT)
+#define MAXPAGESIZE (1 << MAXPAGESHIFT)
 
-#define MAXPAGES 4096
+#ifndef KPAGE_PAGESIZE
+#define KPAGE_PAGESIZE 8192
+#endif
+
+/* pages per pool chunk, a power of two; the pool grows by chunks */
+#ifndef KPAGE_MAXPAGES
+#define KPAGE_MAXPAGES 4096
+#endif
+
+/* the current page size, its log2 and the pages per chunk, see
+ * set_page_size() */
+#define PAGESIZE gPageSize
+#define PAGESHIFT gPageShift
+#define MAXPAGES gMaxPages
+
+#ifndef MAXCHUNKS
+#define MAXCHUNKS 256
+#endif
+
+/* where the pool memory comes from */
+#define KPAGE_MEMALIGN 0  /* posix_memalign() */
+#define KPAGE_MMAP 1      /* mmap(MAP_NORESERVE), committed as pages are used */
+
+#ifndef KPAGE_BACKEND
+#define KPAGE_BACKEND KPAGE_MMAP
+#endif
+
+/* how a new chunk is set up: lazily, handing out its pages from a bump
+ * pointer and threading only freed ones on the free lists, or eagerly,
+ * threading all of its pages on the free lists when it is mapped */
+#define KPAGE_LAZY 0
+#define KPAGE_EAGER 1
+
+#ifndef KPAGE_STARTUP
+#define KPAGE_STARTUP KPAGE_LAZY
+#endif
+
+/* back the pool with transparent huge pages (MADV_HUGEPAGE), so that
+ * one TLB entry covers many pages; releasing single pages splits the
+ * huge page they sit in */
+#ifndef KPAGE_HUGEPAGES
+#define KPAGE_HUGEPAGES 0
+#endif
+
+/* what happens to the pool once its last page is freed */
+#define KPAGE_RETAIN 0    /* keep the pool and its memory */
+#define KPAGE_MADVISE 1   /* keep the pool, return its memory to the OS */
+#define KPAGE_TEARDOWN 2  /* free the pool, rebuild it on the next request */
+
+#ifndef KPAGE_RETENTION
+#define KPAGE_RETENTION KPAGE_MADVISE
+#endif
+
+/* a drained pool is only released if it stayed idle at least this long
+ * (in microseconds) the last time it drained */
+#ifndef KPAGE_IDLE_THRESHOLD
+#define KPAGE_IDLE_THRESHOLD 1000
+#endif
+
+/* free pages are returned to the OS once more than KPAGE_RELEASE_HIGH
+ * of them still hold memory, oldest first, until KPAGE_RELEASE_LOW are
+ * left; 0 turns the release off */
+#ifndef KPAGE_RELEASE_HIGH
+#define KPAGE_RELEASE_HIGH 0
+#endif
+
+#ifndef KPAGE_RELEASE_LOW
+#define KPAGE_RELEASE_LOW (KPAGE_RELEASE_HIGH / 2)
+#endif
+
+/* how released pages are handed back, MADV_DONTNEED or MADV_FREE */
+#ifndef KPAGE_RELEASE_ADVICE
+#define KPAGE_RELEASE_ADVICE MADV_DONTNEED
+#endif
+
+/* the page layer may be used from any thread: single pages are freed
+ * to and allocated from a lock-free stack of up to KPAGE_STACK_LIMIT
+ * pages, everything else goes through the locked buddy system; 0 sends
+ * every page through the buddy system */
+#ifndef KPAGE_STACK_LIMIT
+#define KPAGE_STACK_LIMIT 256
+#endif
+
+/* every thread caches up to KPAGE_CACHE_LIMIT free single pages in
+ * front of the page stack, taken from and given back to the pool
+ * KPAGE_CACHE_BATCH pages at a time; 0 turns the caches off */
+#ifndef KPAGE_CACHE_LIMIT
+#define KPAGE_CACHE_LIMIT 64
+#endif
+
+#ifndef KPAGE_CACHE_BATCH
+#define KPAGE_CACHE_BATCH 16
+#endif
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -93,10 +190,18 @@ typedef struct
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_rebuilds;
+  int num_chunks;
+  int num_released;
+  int num_resident;
 } kpage_stat_t;
 
 /************Global Variables*********************************************/
 
+EXTERN int gPageSize;
+EXTERN int gPageShift;
+EXTERN int gMaxPages;
+
 /************Function Prototypes******************************************/
 
 /***********************************************************************
@@ -117,6 +222,136 @@ EXTERN kpage_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kpage_t*);
 
+/***********************************************************************
+ *  Title: Allocates continuous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a physically continuous run of pages. The run
+ *             starts on a page boundary and is described by a single
+ *             page structure whose size covers all pages.
+ *    Input: the number of pages
+ *    Output: the allocated memory pages or NULL if no run of the
+ *            requested length is available
+ ***********************************************************************/
+EXTERN kpage_t* get_pages(int);
+
+/***********************************************************************
+ *  Title: Releases continuous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run of pages allocated by get_pages()
+ *    Input: the pointer to the memory page structure
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kpage_t*);
+
+/***********************************************************************
+ *  Title: Looks up a memory page
+ * ---------------------------------------------------------------------
+ *    Purpose: Finds the page structure of a page in constant time, so
+ *             allocators do not need to keep it in the page itself
+ *    Input: a pointer into the page (for a run of pages, into its
+ *           first page)
+ *    Output: the memory page structure
+ ***********************************************************************/
+EXTERN kpage_t* lookup_page(void*);
+
+/***********************************************************************
+ *  Title: Checks page ownership
+ * ---------------------------------------------------------------------
+ *    Purpose: Tells whether a pointer points into the page pool
+ *    Input: the pointer
+ *    Output: non-zero if the pointer is inside the pool
+ ***********************************************************************/
+EXTERN int page_in_pool(void*);
+
+/***********************************************************************
+ *  Title: Sets the pool retention policy
+ * ---------------------------------------------------------------------
+ *    Purpose: Chooses what happens to the pool when its last page is
+ *             freed (KPAGE_RETAIN, KPAGE_MADVISE or KPAGE_TEARDOWN)
+ *    Input: the policy, the idle threshold in microseconds
+ *    Output: none
+ ***********************************************************************/
+EXTERN void set_page_retention(int, int);
+
+/***********************************************************************
+ *  Title: Sets the page release watermarks
+ * ---------------------------------------------------------------------
+ *    Purpose: Returns free pages to the OS in batches once more than
+ *             the high watermark of free pages hold memory, down to
+ *             the low watermark
+ *    Input: the high watermark (0 turns the release off), the low
+ *           watermark
+ *    Output: none
+ ***********************************************************************/
+EXTERN void set_page_release(int, int);
+
+/***********************************************************************
+ *  Title: Sets the pool backend
+ * ---------------------------------------------------------------------
+ *    Purpose: Chooses how the pool memory is obtained (KPAGE_MEMALIGN
+ *             or KPAGE_MMAP); takes effect the next time the pool is
+ *             built
+ *    Input: the backend
+ *    Output: none
+ ***********************************************************************/
+EXTERN void set_page_backend(int);
+
+/***********************************************************************
+ *  Title: Sets the chunk startup
+ * ---------------------------------------------------------------------
+ *    Purpose: Chooses how new chunks are set up (KPAGE_LAZY or
+ *             KPAGE_EAGER); takes effect for the chunks mapped from
+ *             then on
+ *    Input: the startup
+ *    Output: none
+ ***********************************************************************/
+EXTERN void set_page_startup(int);
+
+/***********************************************************************
+ *  Title: Sets huge page backing
+ * ---------------------------------------------------------------------
+ *    Purpose: Asks for transparent huge pages behind the chunks mapped
+ *             from now on
+ *    Input: non-zero to use huge pages
+ *    Output: none
+ ***********************************************************************/
+EXTERN void set_page_hugepages(int);
+
+/***********************************************************************
+ *  Title: Sets the page and pool size
+ * ---------------------------------------------------------------------
+ *    Purpose: Chooses the page size (a power of two between
+ *             MINPAGESIZE and MAXPAGESIZE) and the pages per pool
+ *             chunk (a power of two); only possible while no pool has
+ *             been built, that is before the first page is allocated
+ *    Input: the page size, the pages per chunk
+ *    Output: non-zero if the sizes were taken
+ ***********************************************************************/
+EXTERN int set_page_size(int, int);
+
+/***********************************************************************
+ *  Title: Sets the page stack limit
+ * ---------------------------------------------------------------------
+ *    Purpose: Chooses how many free single pages the lock-free page
+ *             stack holds before pages go back to the buddy system
+ *    Input: the limit, 0 turns the page stack off
+ *    Output: none
+ ***********************************************************************/
+EXTERN void set_page_stack(int);
+
+/***********************************************************************
+ *  Title: Sets the page cache size
+ * ---------------------------------------------------------------------
+ *    Purpose: Chooses how many free single pages each thread caches
+ *             (at most KPAGE_CACHE_LIMIT) and how many pages move
+ *             between a cache and the pool at once; a thread gives
+ *             its cache back when it exits or frees the last page in
+ *             use
+ *    Input: the limit (0 turns the caches off), the batch size
+ *    Output: none
+ ***********************************************************************/
+EXTERN void set_page_cache(int, int);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
@@ -126,6 +361,44 @@ EXTERN void free_page(kpage_t*);
  ***********************************************************************/
 EXTERN kpage_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Memory pages in use
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the number of pages handed out, without taking the
+ *             pool lock page_stats() needs
+ *    Input: none
+ *    Output: the number of pages in use
+ ***********************************************************************/
+EXTERN int pages_in_use();
+
+/***********************************************************************
+ *  Title: Rebuild the memory page pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Tears the pool down, whatever the retention policy, so
+ *             the next request builds it from scratch; pages cached by
+ *             the calling thread go back first, with pages still out
+ *             (in use or in the cache of another thread) the pool is
+ *             left alone
+ *    Input: none
+ *    Output: non-zero if the pool was torn down
+ ***********************************************************************/
+EXTERN int reset_pages();
+
+/***********************************************************************
+ *  Title: Memory page pool across fork
+ * ---------------------------------------------------------------------
+ *    Purpose: Keep the pool consistent in a child of a threaded
+ *             process, meant as pthread_atfork() handlers: the
+ *             prepare hook takes the pool lock so no other thread
+ *             holds it while forking, the parent hook releases it,
+ *             the child hook sets it up afresh
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_fork_prepare();
+EXTERN void page_fork_parent();
+EXTERN void page_fork_child();
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
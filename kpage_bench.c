@@ -0,0 +1,311 @@
+/***************************************************************************
+ *  Title: Kernel Page Allocator Benchmark
+ * -------------------------------------------------------------------------
+ *    Purpose: Micro benchmarks for the kernel page allocator
+ *    File: kpage_bench.c
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    - startup latency and resident memory of the pool backends, with
+ *      eager and lazy chunk startup
+ *    - random page access latency with and without huge pages
+ *    - page churn throughput from several threads
+ *
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define STARTUP_ITERATIONS 1000
+#define TLB_PAGES 4096
+#define TLB_ACCESSES 20000000
+#define CHURN_THREADS 4
+#define CHURN_PAGES 64
+#define CHURN_OPS 1000000
+
+/************Global Variables*********************************************/
+
+static char* backend_names[] = { "memalign", "mmap" };
+
+// keeps the page reads of bench_tlb from being optimized away
+volatile long gSink;
+
+/************Function Prototypes******************************************/
+void bench_startup(int, int, int);
+void bench_tlb(int, int);
+void bench_churn(char*, int, int, int);
+void* churn(void*);
+double elapsed(struct timespec*, struct timespec*);
+long resident_kb();
+void usage();
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+char *name = NULL;
+
+int
+main(int argc, char* argv[])
+{
+  int count = 0;
+
+  name = argv[0];
+
+  if (argc < 2 || argc > 3)
+    {
+      usage();
+    }
+  if (argc == 3)
+    {
+      count = atoi(argv[2]);
+      if (count <= 0)
+	{
+	  usage();
+	}
+    }
+
+  // build the pool from scratch for every run
+  set_page_retention(KPAGE_TEARDOWN, 0);
+
+  if (strcmp(argv[1], "startup") == 0)
+    {
+      if (count == 0)
+	{
+	  count = STARTUP_ITERATIONS;
+	}
+      printf("%-10s %-8s %18s %18s\n", "backend", "startup",
+	     "first page (us)", "resident (KB)");
+      bench_startup(KPAGE_MEMALIGN, KPAGE_EAGER, count);
+      bench_startup(KPAGE_MEMALIGN, KPAGE_LAZY, count);
+      bench_startup(KPAGE_MMAP, KPAGE_EAGER, count);
+      bench_startup(KPAGE_MMAP, KPAGE_LAZY, count);
+    }
+  else if (strcmp(argv[1], "churn") == 0)
+    {
+      if (count == 0)
+	{
+	  count = CHURN_THREADS;
+	}
+      printf("%-10s %8s %18s\n", "free list", "threads", "ops (M/s)");
+      bench_churn("locked", 0, 0, count);
+      bench_churn("stack", KPAGE_STACK_LIMIT, 0, count);
+      bench_churn("cache", KPAGE_STACK_LIMIT, KPAGE_CACHE_LIMIT, count);
+    }
+  else if (strcmp(argv[1], "tlb") == 0)
+    {
+      if (count == 0)
+	{
+	  count = TLB_PAGES;
+	}
+      printf("%-10s %18s\n", "backing", "access (ns)");
+      bench_tlb(FALSE, count);
+      bench_tlb(TRUE, count);
+    }
+  else
+    {
+      usage();
+    }
+
+  return 0;
+}
+
+// time from an empty page layer to the first page being usable, with
+// the first chunk set up eagerly or lazily
+void
+bench_startup(int backend, int startup, int iterations)
+{
+  struct timespec start, end;
+  double total = 0.0;
+  long rss_before, rss_after = 0;
+  kpage_t* page;
+  int i;
+
+  set_page_backend(backend);
+  set_page_startup(startup);
+
+  for (i = 0; i < iterations; i++)
+    {
+      rss_before = resident_kb();
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      page = get_page();
+      *((char*)page->ptr) = 1;
+      clock_gettime(CLOCK_MONOTONIC, &end);
+
+      total += elapsed(&start, &end);
+      rss_after += resident_kb() - rss_before;
+
+      free_page(page);
+    }
+
+  printf("%-10s %-8s %18.2f %18ld\n", backend_names[backend],
+	 startup == KPAGE_EAGER ? "eager" : "lazy", total / iterations,
+	 rss_after / iterations);
+  set_page_startup(KPAGE_STARTUP);
+}
+
+// random word reads spread over many pages, dominated by TLB misses
+// once the pages outgrow the TLB reach
+void
+bench_tlb(int hugepages, int npages)
+{
+  struct timespec start, end;
+  kpage_t** pages = malloc(npages * sizeof(kpage_t*));
+  unsigned int seed = 343;
+  long sum = 0;
+  int i;
+
+  assert(pages != NULL);
+  set_page_backend(KPAGE_MMAP);
+  set_page_hugepages(hugepages);
+
+  for (i = 0; i < npages; i++)
+    {
+      pages[i] = get_page();
+      memset(pages[i]->ptr, i, PAGESIZE);
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < TLB_ACCESSES; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      sum += ((long*)pages[(seed >> 8) % npages]->ptr)[(seed >> 4) % 16 * 64];
+    }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("%-10s %18.2f\n", hugepages ? "huge" : "regular",
+	 elapsed(&start, &end) * 1000 / TLB_ACCESSES);
+  gSink = sum;
+
+  for (i = 0; i < npages; i++)
+    {
+      free_page(pages[i]);
+    }
+  free(pages);
+}
+
+// page allocations and frees per second from 1 to nthreads threads,
+// each replacing pages of its own working set
+void
+bench_churn(char* label, int stack, int cache, int nthreads)
+{
+  struct timespec start, end;
+  pthread_t threads[nthreads];
+  int i, n;
+
+  set_page_backend(KPAGE_MMAP);
+  set_page_stack(stack);
+  set_page_cache(cache, KPAGE_CACHE_BATCH);
+
+  for (n = 1; n <= nthreads; n++)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (i = 0; i < n; i++)
+	{
+	  if (pthread_create(&threads[i], NULL, churn, NULL) != 0)
+	    {
+	      error("unable to start churn thread", "");
+	    }
+	}
+      for (i = 0; i < n; i++)
+	{
+	  pthread_join(threads[i], NULL);
+	}
+      clock_gettime(CLOCK_MONOTONIC, &end);
+
+      printf("%-10s %8d %18.2f\n", label, n,
+	     (double)n * CHURN_OPS / elapsed(&start, &end));
+    }
+}
+
+void*
+churn(void* arg)
+{
+  kpage_t* pages[CHURN_PAGES];
+  unsigned int seed = (unsigned long)pthread_self();
+  int i, slot;
+
+  for (i = 0; i < CHURN_PAGES; i++)
+    {
+      pages[i] = get_page();
+    }
+
+  for (i = 0; i < CHURN_OPS; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      slot = (seed >> 8) % CHURN_PAGES;
+      free_page(pages[slot]);
+      pages[slot] = get_page();
+      *((char*)pages[slot]->ptr) = i;
+    }
+
+  for (i = 0; i < CHURN_PAGES; i++)
+    {
+      free_page(pages[i]);
+    }
+
+  return NULL;
+}
+
+// microseconds between two time stamps
+double
+elapsed(struct timespec* start, struct timespec* end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e6
+    + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+// resident set size of the process
+long
+resident_kb()
+{
+  long size, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+
+  if (f == NULL)
+    {
+      return 0;
+    }
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+    {
+      resident = 0;
+    }
+  fclose(f);
+
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void
+usage()
+{
+  printf("Usage: %s {startup [iterations] | tlb [pages] | churn [threads]}\n",
+	 name);
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
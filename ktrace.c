@@ -0,0 +1,266 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Traces
+ * -------------------------------------------------------------------------
+ *    Purpose: Binary trace format and trace loading for the test driver
+ *    File: ktrace.c
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    - binary trace format, text traces parsed into it
+ *
+ ***************************************************************************/
+#define __KTRACE_IMPL__
+
+/************System include***********************************************/
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/************Private include**********************************************/
+#include "kma.h"
+#include "ktrace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+ktrace_t* mapTrace(int, size_t);
+ktrace_t* parseTrace(FILE*);
+ktrace_rec_t* parseRecords(FILE*, ktrace_hdr_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+ktrace_t*
+ktrace_open(char* path)
+{
+  char magic[sizeof(KTRACE_MAGIC) - 1];
+  struct stat st;
+  ktrace_t* trace = NULL;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    {
+      return NULL;
+    }
+
+  // a binary trace starts with the magic, everything else is text
+  if (fstat(fd, &st) == 0
+      && read(fd, magic, sizeof(magic)) == sizeof(magic)
+      && memcmp(magic, KTRACE_MAGIC, sizeof(magic)) == 0)
+    {
+      trace = mapTrace(fd, st.st_size);
+      close(fd);
+    }
+  else if (lseek(fd, 0, SEEK_SET) == 0)
+    {
+      FILE* file = fdopen(fd, "r");
+      if (file == NULL)
+	{
+	  close(fd);
+	  return NULL;
+	}
+      trace = parseTrace(file);
+      fclose(file);
+    }
+  else
+    {
+      close(fd);
+    }
+
+  return trace;
+}
+
+int
+ktrace_write(ktrace_t* trace, char* path)
+{
+  FILE* file = fopen(path, "wb");
+  int ok;
+
+  if (file == NULL)
+    {
+      return FALSE;
+    }
+
+  ok = fwrite(trace->hdr, sizeof(ktrace_hdr_t), 1, file) == 1
+    && fwrite(trace->recs, sizeof(ktrace_rec_t), trace->hdr->n_ops, file)
+       == trace->hdr->n_ops;
+
+  return fclose(file) == 0 && ok;
+}
+
+void
+ktrace_close(ktrace_t* trace)
+{
+  if (trace->mapped)
+    {
+      munmap(trace->hdr, trace->mapped);
+    }
+  else
+    {
+      free(trace->recs);
+      free(trace->hdr);
+    }
+  free(trace);
+}
+
+ktrace_t*
+mapTrace(int fd, size_t length)
+{
+  ktrace_hdr_t* hdr;
+  ktrace_t* trace;
+
+  if (length < sizeof(ktrace_hdr_t))
+    {
+      return NULL;
+    }
+
+  hdr = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  if (hdr == MAP_FAILED)
+    {
+      return NULL;
+    }
+
+  if (hdr->version != KTRACE_VERSION
+      || length != sizeof(ktrace_hdr_t)
+                   + (size_t) hdr->n_ops * sizeof(ktrace_rec_t)
+      || (trace = malloc(sizeof(ktrace_t))) == NULL)
+    {
+      munmap(hdr, length);
+      return NULL;
+    }
+
+  trace->hdr = hdr;
+  trace->recs = (ktrace_rec_t*) (hdr + 1);
+  trace->mapped = length;
+
+  return trace;
+}
+
+ktrace_t*
+parseTrace(FILE* file)
+{
+  ktrace_hdr_t* hdr = calloc(1, sizeof(ktrace_hdr_t));
+  ktrace_t* trace = malloc(sizeof(ktrace_t));
+  ktrace_rec_t* recs = NULL;
+
+  if (hdr != NULL && trace != NULL
+      && fscanf(file, "%u\n", &hdr->n_req) == 1 && hdr->n_req > 0)
+    {
+      recs = parseRecords(file, hdr);
+    }
+
+  if (recs == NULL)
+    {
+      free(trace);
+      free(hdr);
+      return NULL;
+    }
+
+  memcpy(hdr->magic, KTRACE_MAGIC, sizeof(hdr->magic));
+  hdr->version = KTRACE_VERSION;
+
+  trace->hdr = hdr;
+  trace->recs = recs;
+  trace->mapped = 0;
+
+  return trace;
+}
+
+ktrace_rec_t*
+parseRecords(FILE* file, ktrace_hdr_t* hdr)
+{
+  unsigned int capacity = hdr->n_req;
+  ktrace_rec_t* recs = malloc(capacity * sizeof(ktrace_rec_t));
+  // the size of every pending request, 0 once freed
+  unsigned int* live = calloc(hdr->n_req, sizeof(unsigned int));
+  unsigned long long inUse = 0;
+  unsigned int id, size;
+  char command[16];
+  int ok = recs != NULL && live != NULL;
+
+  while (ok && fscanf(file, "%10s", command) == 1)
+    {
+      if (hdr->n_ops == capacity)
+	{
+	  ktrace_rec_t* grown = realloc(recs, 2 * capacity * sizeof(ktrace_rec_t));
+	  if (grown == NULL)
+	    {
+	      ok = FALSE;
+	      break;
+	    }
+	  recs = grown;
+	  capacity *= 2;
+	}
+
+      if (strcmp(command, "REQUEST") == 0)
+	{
+	  ok = fscanf(file, "%u %u", &id, &size) == 2
+	    && id < hdr->n_req && live[id] == 0 && size > 0;
+	  if (!ok)
+	    {
+	      break;
+	    }
+
+	  recs[hdr->n_ops].op = KTRACE_REQUEST;
+	  live[id] = size;
+	  inUse += size;
+	  hdr->n_alloc++;
+	  hdr->total_bytes += size;
+	  if (size > hdr->max_size)
+	    {
+	      hdr->max_size = size;
+	    }
+	  if (inUse > hdr->peak_bytes)
+	    {
+	      hdr->peak_bytes = inUse;
+	    }
+	}
+      else if (strcmp(command, "FREE") == 0)
+	{
+	  ok = fscanf(file, "%u", &id) == 1
+	    && id < hdr->n_req && live[id] != 0;
+	  if (!ok)
+	    {
+	      break;
+	    }
+
+	  recs[hdr->n_ops].op = KTRACE_FREE;
+	  size = live[id];
+	  live[id] = 0;
+	  inUse -= size;
+	  hdr->n_free++;
+	}
+      else
+	{
+	  ok = FALSE;
+	  break;
+	}
+
+      recs[hdr->n_ops].id = id;
+      recs[hdr->n_ops].size = size;
+      hdr->n_ops++;
+    }
+
+  free(live);
+  if (!ok || !feof(file))
+    {
+      free(recs);
+      return NULL;
+    }
+
+  return recs;
+}
@@ -0,0 +1,111 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Traces
+ * -------------------------------------------------------------------------
+ *    Purpose: Binary trace format and trace loading for the test driver
+ *    File: ktrace.h
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    - binary trace format, text traces parsed into it
+ *
+ ***************************************************************************/
+
+#ifndef __KTRACE_H__
+#define __KTRACE_H__
+
+/************System include***********************************************/
+#include <stddef.h>
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KTRACE_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* a binary trace is a header followed by n_ops fixed-width records,
+ * all in host byte order, so it can be mapped and replayed as is */
+#define KTRACE_MAGIC "KMATRACE"
+#define KTRACE_VERSION 1
+
+enum KTRACE_OP
+  {
+    KTRACE_REQUEST,
+    KTRACE_FREE
+  };
+
+typedef struct
+{
+  unsigned int op;
+  unsigned int id;     /* below n_req */
+  unsigned int size;   /* a FREE carries the size of its REQUEST */
+} ktrace_rec_t;
+
+typedef struct
+{
+  char magic[8];
+  unsigned int version;
+  unsigned int n_req;
+  unsigned int n_ops;
+  unsigned int n_alloc;
+  unsigned int n_free;
+  unsigned int max_size;
+  unsigned long long total_bytes;
+  unsigned long long peak_bytes;   /* most bytes in use at once */
+} ktrace_hdr_t;
+
+typedef struct
+{
+  ktrace_hdr_t* hdr;
+  ktrace_rec_t* recs;
+  size_t mapped;       /* bytes mapped, 0 when parsed from text */
+} ktrace_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Opens a trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Maps a binary trace, or parses a text trace into the
+ *             binary format in memory
+ *    Input: the path of the trace file
+ *    Output: the trace or NULL if the file cannot be read or is
+ *            malformed
+ ***********************************************************************/
+EXTERN ktrace_t* ktrace_open(char* path);
+
+/***********************************************************************
+ *  Title: Writes a binary trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Stores a trace in the binary format
+ *    Input: the trace, the path of the output file
+ *    Output: TRUE on success, FALSE otherwise
+ ***********************************************************************/
+EXTERN int ktrace_write(ktrace_t* trace, char* path);
+
+/***********************************************************************
+ *  Title: Closes a trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Unmaps or frees a trace returned by ktrace_open()
+ *    Input: the trace
+ *    Output: none
+ ***********************************************************************/
+EXTERN void ktrace_close(ktrace_t* trace);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KTRACE_H__ */
@@ -0,0 +1,87 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Trace Converter
+ * -------------------------------------------------------------------------
+ *    Purpose: Converts text traces into the binary trace format
+ *    File: ktrace_conv.c
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    - text to binary trace conversion
+ *
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+#include "kma.h"
+#include "ktrace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+void usage();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+char *name = NULL;
+
+int
+main(int argc, char* argv[])
+{
+  ktrace_t* trace;
+  ktrace_hdr_t* hdr;
+
+  name = argv[0];
+
+  if (argc != 3)
+    {
+      usage();
+    }
+
+  trace = ktrace_open(argv[1]);
+  if (trace == NULL)
+    {
+      error("unable to read trace file", argv[1]);
+    }
+
+  if (!ktrace_write(trace, argv[2]))
+    {
+      error("unable to write trace file", argv[2]);
+    }
+
+  hdr = trace->hdr;
+  printf("%s: %u requests, %u operations\n", argv[2], hdr->n_req, hdr->n_ops);
+  printf("%u allocations, %u deallocations\n", hdr->n_alloc, hdr->n_free);
+  printf("Maximum request size: %u\n", hdr->max_size);
+  printf("Total bytes allocated: %llu\n", hdr->total_bytes);
+  printf("Maximum bytes allocated: %llu\n", hdr->peak_bytes);
+
+  ktrace_close(trace);
+  return 0;
+}
+
+void
+usage()
+{
+  printf("Usage: %s textTrace binaryTrace\n", name);
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
@@ -0,0 +1,538 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Trace Recorder
+ * -------------------------------------------------------------------------
+ *    Purpose: Records the heap operations of a process as a trace,
+ *             preload libktrace.so to use it:
+ *               LD_PRELOAD=./libktrace.so KTRACE_FILE=app.trace app
+ *    File: ktrace_rec.c
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    - malloc family interposition, per thread event buffers
+ *
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <errno.h>
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/* settings, from the environment:
+ *  KTRACE_FILE      the trace to write, kma_recorded.trace by default;
+ *                   a %d in it becomes the process id, so the children
+ *                   of the process, which inherit the preload, do not
+ *                   overwrite its trace
+ *  KTRACE_MAXSIZE   requests above this many bytes are oversize, by
+ *                   default those a pool chunk cannot hold; 0 for none
+ *  KTRACE_OVERSIZE  "cap" records oversize requests with the maximum
+ *                   size, "drop" leaves them and their frees out */
+#define DEFAULT_FILE "kma_recorded.trace"
+#define DEFAULT_MAXSIZE ((KPAGE_MAXPAGES - 1) * (size_t) KPAGE_PAGESIZE)
+
+/* events are kept in chunks of their thread until the process exits,
+ * the sequence numbers order them across threads */
+#define CHUNKEVENTS 65536
+#define BOOTSTRAPSIZE 65536
+
+enum EVENT_OP
+  {
+    EV_REQUEST,
+    EV_FREE
+  };
+
+typedef struct
+{
+  unsigned long long seq;
+  void* ptr;
+  size_t size;
+  int op;
+} event_t;
+
+typedef struct chunk
+{
+  struct chunk* next;
+  int count;
+  event_t events[CHUNKEVENTS];
+} chunk_t;
+
+/* the id of a live pointer, in an open addressing table */
+typedef struct
+{
+  void* ptr;
+  unsigned int id;
+  int dropped;
+} slot_t;
+
+/************Global Variables*********************************************/
+
+static void* (*realMalloc)(size_t);
+static void (*realFree)(void*);
+static void* (*realCalloc)(size_t, size_t);
+static void* (*realRealloc)(void*, size_t);
+static int (*realMemalign)(void**, size_t, size_t);
+
+/* dlsym may allocate before the real functions are known */
+static char bootstrap[BOOTSTRAPSIZE];
+static size_t bootstrapUsed = 0;
+
+static unsigned long long gSeq = 0;
+static chunk_t* gChunks = NULL;
+static int gRecording = FALSE;
+
+static __thread chunk_t* current = NULL;
+/* set while the recorder itself allocates */
+static __thread int inside = FALSE;
+
+/************Function Prototypes******************************************/
+void resolve();
+unsigned long long nextSeq();
+void record(int, void*, size_t, unsigned long long);
+chunk_t* newChunk();
+void writeTrace();
+int compareEvents(const void*, const void*);
+slot_t* findSlot(slot_t*, size_t, void*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+malloc(size_t size)
+{
+  void* ptr;
+
+  if (realMalloc == NULL)
+    {
+      resolve();
+    }
+  if (realMalloc == NULL)
+    {
+      // still inside dlsym, carve from the bootstrap buffer
+      size = (size + 15) & ~15;
+      if (bootstrapUsed + size > BOOTSTRAPSIZE)
+	{
+	  return NULL;
+	}
+      ptr = bootstrap + bootstrapUsed;
+      bootstrapUsed += size;
+      return ptr;
+    }
+
+  ptr = realMalloc(size);
+  if (ptr != NULL)
+    {
+      record(EV_REQUEST, ptr, size, nextSeq());
+    }
+  return ptr;
+}
+
+void
+free(void* ptr)
+{
+  if (ptr == NULL
+      || ((char*) ptr >= bootstrap && (char*) ptr < bootstrap + BOOTSTRAPSIZE))
+    {
+      return;
+    }
+  if (realFree == NULL)
+    {
+      resolve();
+    }
+  if (realFree == NULL)
+    {
+      // not from the bootstrap buffer, yet nothing real to give it back to
+      return;
+    }
+
+  // the sequence number is taken before the memory can be reused
+  record(EV_FREE, ptr, 0, nextSeq());
+  realFree(ptr);
+}
+
+void*
+calloc(size_t count, size_t size)
+{
+  void* ptr;
+
+  if (realCalloc == NULL)
+    {
+      resolve();
+    }
+  if (realCalloc == NULL)
+    {
+      // the bootstrap buffer is static, so already zeroed
+      ptr = malloc(count * size);
+      if (ptr != NULL && realMalloc != NULL)
+	{
+	  memset(ptr, 0, count * size);
+	}
+      return ptr;
+    }
+
+  ptr = realCalloc(count, size);
+  if (ptr != NULL)
+    {
+      record(EV_REQUEST, ptr, count * size, nextSeq());
+    }
+  return ptr;
+}
+
+void*
+realloc(void* old, size_t size)
+{
+  unsigned long long seq;
+  size_t copy;
+  void* ptr;
+
+  if (old == NULL)
+    {
+      return malloc(size);
+    }
+  if ((char*) old >= bootstrap && (char*) old < bootstrap + BOOTSTRAPSIZE)
+    {
+      // the old size is not kept, copy no further than the buffer's end
+      copy = bootstrap + BOOTSTRAPSIZE - (char*) old;
+      ptr = malloc(size);
+      if (ptr != NULL)
+	{
+	  memcpy(ptr, old, size < copy ? size : copy);
+	}
+      return ptr;
+    }
+  if (realRealloc == NULL)
+    {
+      resolve();
+    }
+  if (realRealloc == NULL)
+    {
+      return NULL;
+    }
+
+  // a moved or resized buffer is a free and a new request
+  seq = nextSeq();
+  ptr = realRealloc(old, size);
+  if (ptr != NULL || size == 0)
+    {
+      record(EV_FREE, old, 0, seq);
+    }
+  if (ptr != NULL)
+    {
+      record(EV_REQUEST, ptr, size, nextSeq());
+    }
+  return ptr;
+}
+
+int
+posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+  int status;
+
+  if (realMemalign == NULL)
+    {
+      resolve();
+    }
+  if (realMemalign == NULL)
+    {
+      return ENOMEM;
+    }
+
+  status = realMemalign(ptr, alignment, size);
+  if (status == 0)
+    {
+      record(EV_REQUEST, *ptr, size, nextSeq());
+    }
+  return status;
+}
+
+void*
+aligned_alloc(size_t alignment, size_t size)
+{
+  void* ptr;
+
+  return posix_memalign(&ptr, alignment, size) == 0 ? ptr : NULL;
+}
+
+void*
+memalign(size_t alignment, size_t size)
+{
+  return aligned_alloc(alignment, size);
+}
+
+__attribute__((constructor)) void
+start()
+{
+  resolve();
+  __atomic_store_n(&gRecording, TRUE, __ATOMIC_RELEASE);
+}
+
+__attribute__((destructor)) void
+stop()
+{
+  inside = TRUE;
+  writeTrace();
+  inside = FALSE;
+}
+
+void
+resolve()
+{
+  static int resolving = FALSE;
+
+  if (resolving)
+    {
+      return;
+    }
+  resolving = TRUE;
+
+  realMalloc = dlsym(RTLD_NEXT, "malloc");
+  realFree = dlsym(RTLD_NEXT, "free");
+  realCalloc = dlsym(RTLD_NEXT, "calloc");
+  realRealloc = dlsym(RTLD_NEXT, "realloc");
+  realMemalign = dlsym(RTLD_NEXT, "posix_memalign");
+
+  resolving = FALSE;
+}
+
+unsigned long long
+nextSeq()
+{
+  return __atomic_fetch_add(&gSeq, 1, __ATOMIC_RELAXED);
+}
+
+void
+record(int op, void* ptr, size_t size, unsigned long long seq)
+{
+  event_t* event;
+
+  if (inside || !__atomic_load_n(&gRecording, __ATOMIC_ACQUIRE))
+    {
+      return;
+    }
+
+  if (current == NULL || current->count == CHUNKEVENTS)
+    {
+      current = newChunk();
+      if (current == NULL)
+	{
+	  return;
+	}
+    }
+
+  // only this thread writes its chunk, the count is published last
+  event = &current->events[current->count];
+  event->seq = seq;
+  event->ptr = ptr;
+  event->size = size;
+  event->op = op;
+  __atomic_store_n(&current->count, current->count + 1, __ATOMIC_RELEASE);
+}
+
+chunk_t*
+newChunk()
+{
+  chunk_t* chunk = mmap(NULL, sizeof(chunk_t), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (chunk == MAP_FAILED)
+    {
+      return NULL;
+    }
+
+  chunk->count = 0;
+  chunk->next = __atomic_load_n(&gChunks, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&gChunks, &chunk->next, chunk, TRUE,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+    }
+
+  return chunk;
+}
+
+void
+writeTrace()
+{
+  char* format = getenv("KTRACE_FILE");
+  char* limit = getenv("KTRACE_MAXSIZE");
+  char* oversize = getenv("KTRACE_OVERSIZE");
+  size_t maxSize = limit != NULL ? strtoul(limit, NULL, 0) : DEFAULT_MAXSIZE;
+  int drop = oversize != NULL && strcmp(oversize, "drop") == 0;
+  size_t n_events = 0, i;
+  unsigned int n_req = 0, n_over = 0, n_live = 0;
+  chunk_t *head, *chunk;
+  int n_chunks = 0, c;
+
+  char path[256];
+  char* pid;
+
+  if (format == NULL)
+    {
+      format = DEFAULT_FILE;
+    }
+  pid = strstr(format, "%d");
+  if (pid != NULL)
+    {
+      snprintf(path, sizeof(path), "%.*s%d%s", (int) (pid - format), format,
+	       getpid(), pid + 2);
+    }
+  else
+    {
+      snprintf(path, sizeof(path), "%s", format);
+    }
+
+  // gather the events of every thread in sequence order; a thread
+  // past the gRecording check may still add one, so every count is
+  // read once and the same counts size and fill the events
+  __atomic_store_n(&gRecording, FALSE, __ATOMIC_RELEASE);
+  head = __atomic_load_n(&gChunks, __ATOMIC_ACQUIRE);
+  for (chunk = head; chunk != NULL; chunk = chunk->next)
+    {
+      n_chunks++;
+    }
+
+  int* counts = realMalloc((n_chunks + 1) * sizeof(int));
+  if (counts == NULL)
+    {
+      fprintf(stderr, "ktrace: unable to write trace %s\n", path);
+      return;
+    }
+  for (chunk = head, c = 0; chunk != NULL; chunk = chunk->next, c++)
+    {
+      counts[c] = __atomic_load_n(&chunk->count, __ATOMIC_ACQUIRE);
+      n_events += counts[c];
+    }
+
+  event_t* events = realMalloc((n_events + 1) * sizeof(event_t));
+  slot_t* slots = realCalloc(2 * n_events + 1, sizeof(slot_t));
+  FILE* file = fopen(path, "w");
+  if (events == NULL || slots == NULL || file == NULL)
+    {
+      fprintf(stderr, "ktrace: unable to write trace %s\n", path);
+      return;
+    }
+
+  n_events = 0;
+  for (chunk = head, c = 0; chunk != NULL; chunk = chunk->next, c++)
+    {
+      memcpy(events + n_events, chunk->events, counts[c] * sizeof(event_t));
+      n_events += counts[c];
+    }
+  realFree(counts);
+  qsort(events, n_events, sizeof(event_t), compareEvents);
+
+  // requests get ids in order, frees of pointers never seen (from
+  // before the recording started) are left out; the header counts
+  // the records, written once they are known
+  fprintf(file, "%20s\n", "");
+  for (i = 0; i < n_events; i++)
+    {
+      event_t* event = &events[i];
+      slot_t* slot = findSlot(slots, 2 * n_events + 1, event->ptr);
+
+      if (event->op == EV_REQUEST)
+	{
+	  size_t size = event->size > 0 ? event->size : 1;
+
+	  // a free that went unrecorded, close the old id
+	  if (slot->ptr == event->ptr && !slot->dropped)
+	    {
+	      fprintf(file, "FREE %u\n", slot->id);
+	      n_live--;
+	    }
+
+	  slot->ptr = event->ptr;
+	  slot->id = n_req++;
+	  slot->dropped = FALSE;
+	  if (maxSize > 0 && size > maxSize)
+	    {
+	      n_over++;
+	      size = maxSize;
+	      slot->dropped = drop;
+	    }
+	  if (!slot->dropped)
+	    {
+	      fprintf(file, "REQUEST %u %zu\n", slot->id, size);
+	      n_live++;
+	    }
+	}
+      else if (slot->ptr != NULL)
+	{
+	  if (!slot->dropped)
+	    {
+	      fprintf(file, "FREE %u\n", slot->id);
+	      n_live--;
+	    }
+	  // leave a tombstone so the probe chains stay intact
+	  slot->ptr = (void*) -1;
+	}
+    }
+
+  // the driver wants everything freed in the end
+  for (i = 0; i < 2 * n_events + 1; i++)
+    {
+      if (slots[i].ptr != NULL && slots[i].ptr != (void*) -1
+	  && !slots[i].dropped)
+	{
+	  fprintf(file, "FREE %u\n", slots[i].id);
+	}
+    }
+
+  rewind(file);
+  fprintf(file, "%-20u", n_req);
+  fclose(file);
+
+  fprintf(stderr, "ktrace: %u requests (%u oversize, %s), %u freed at exit, "
+	  "written to %s\n", n_req, n_over, drop ? "dropped" : "capped",
+	  n_live, path);
+
+  realFree(slots);
+  realFree(events);
+}
+
+// by sequence number
+int
+compareEvents(const void* lhs, const void* rhs)
+{
+  const event_t* a = lhs;
+  const event_t* b = rhs;
+
+  return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+// the slot of a live pointer, or the empty slot it would go to
+slot_t*
+findSlot(slot_t* slots, size_t size, void* ptr)
+{
+  size_t index = ((unsigned long) ptr >> 4) * 0x9e3779b97f4a7c15ULL % size;
+  slot_t* tombstone = NULL;
+
+  while (slots[index].ptr != NULL && slots[index].ptr != ptr)
+    {
+      if (slots[index].ptr == (void*) -1 && tombstone == NULL)
+	{
+	  tombstone = &slots[index];
+	}
+      index = (index + 1) % size;
+    }
+
+  if (slots[index].ptr == NULL && tombstone != NULL)
+    {
+      return tombstone;
+    }
+  return &slots[index];
+}
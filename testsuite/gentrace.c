@@ -0,0 +1,461 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Trace Generator
+ * -------------------------------------------------------------------------
+ *    Purpose: Generates allocation traces from workload models
+ *    File: gentrace.c
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    - native replacement of generate_trace, text and binary output
+ *    - bursty, producer/consumer and long/short lived lifetime models
+ *    - request sizes sampled from a histogram file
+ *
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma.h"
+#include "ktrace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/* request sizes: log and linear between min and max like
+ * generate_trace, or sampled from "size weight" lines of a file */
+enum SIZE_MODEL
+  {
+    SIZE_LOG,
+    SIZE_LINEAR,
+    SIZE_HIST
+  };
+
+/* when the buffer of a request is freed:
+ *  uniform  anywhere until the end of the trace, like generate_trace
+ *  early    mostly soon after the request, like generate_trace
+ *  burst    the trace runs in phases and a phase's buffers are freed
+ *           together during the next phase
+ *  fifo     producer/consumer, buffers are freed in request order about
+ *           param requests later
+ *  mixed    a fraction of buffers lives until the end of the trace,
+ *           the rest dies young, param requests on average */
+enum LIFE_MODEL
+  {
+    LIFE_UNIFORM,
+    LIFE_EARLY,
+    LIFE_BURST,
+    LIFE_FIFO,
+    LIFE_MIXED
+  };
+
+/* an operation of the trace at some point in time: requests happen at
+ * whole times, frees in between */
+typedef struct
+{
+  double time;
+  unsigned int id;
+  unsigned int op;
+} event_t;
+
+typedef struct
+{
+  int size;
+  double weight;   /* cumulative */
+} bin_t;
+
+#define DEFAULT_PARAM 64
+#define DEFAULT_LONGLIVED 0.1
+
+/************Global Variables*********************************************/
+
+static char* sizeNames[] = { "log", "linear", "hist=" };
+static char* lifeNames[] = { "uniform", "early", "burst", "fifo", "mixed" };
+
+static unsigned long long gState;
+
+static bin_t* gBins = NULL;
+static int gNumBins = 0;
+
+/************Function Prototypes******************************************/
+double uniform();
+int drawSize(int, int, int);
+double drawFree(int, int, int, int, double);
+void readHistogram(char*);
+int compareEvents(const void*, const void*);
+void usage();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+char *name = NULL;
+
+int
+main(int argc, char* argv[])
+{
+  int opt, binary = FALSE, param = DEFAULT_PARAM;
+  double longLived = DEFAULT_LONGLIVED;
+  unsigned long long seed = time(NULL) ^ getpid();
+  int sizeModel, lifeModel, count, minSize, maxSize, i;
+
+  name = argv[0];
+
+  while ((opt = getopt(argc, argv, "bs:p:l:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'b':
+	  binary = TRUE;
+	  break;
+	case 's':
+	  seed = strtoull(optarg, NULL, 0);
+	  break;
+	case 'p':
+	  param = atoi(optarg);
+	  break;
+	case 'l':
+	  longLived = atof(optarg);
+	  break;
+	default:
+	  usage();
+	}
+    }
+
+  if (argc - optind != 6)
+    {
+      usage();
+    }
+
+  count = atoi(argv[optind]);
+  minSize = atoi(argv[optind + 2]);
+  maxSize = atoi(argv[optind + 3]);
+  if (count <= 0 || minSize <= 0 || maxSize < minSize || param <= 0
+      || longLived < 0.0 || longLived > 1.0)
+    {
+      usage();
+    }
+
+  for (sizeModel = SIZE_HIST; sizeModel > SIZE_LOG; sizeModel--)
+    {
+      if (strncmp(argv[optind + 1], sizeNames[sizeModel],
+		  strlen(sizeNames[sizeModel])) == 0)
+	{
+	  break;
+	}
+    }
+  if (sizeModel == SIZE_HIST)
+    {
+      readHistogram(argv[optind + 1] + strlen(sizeNames[SIZE_HIST]));
+    }
+  else if (strcmp(argv[optind + 1], sizeNames[sizeModel]) != 0)
+    {
+      error("invalid allocation size distribution", argv[optind + 1]);
+    }
+
+  for (lifeModel = LIFE_MIXED; lifeModel > LIFE_UNIFORM; lifeModel--)
+    {
+      if (strcmp(argv[optind + 4], lifeNames[lifeModel]) == 0)
+	{
+	  break;
+	}
+    }
+  if (strcmp(argv[optind + 4], lifeNames[lifeModel]) != 0)
+    {
+      error("invalid deallocation policy", argv[optind + 4]);
+    }
+
+  gState = seed ? seed : 1;
+
+  // every request and its free become events, sorting them by time
+  // gives the trace
+  event_t* events = malloc(2 * (size_t) count * sizeof(event_t));
+  unsigned int* sizes = malloc(count * sizeof(unsigned int));
+  if (events == NULL || sizes == NULL)
+    {
+      error("out of memory for requests", argv[optind]);
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      sizes[i] = drawSize(sizeModel, minSize, maxSize);
+
+      events[2 * i].time = i;
+      events[2 * i].id = i;
+      events[2 * i].op = KTRACE_REQUEST;
+
+      events[2 * i + 1].time = drawFree(lifeModel, i, count, param, longLived);
+      events[2 * i + 1].id = i;
+      events[2 * i + 1].op = KTRACE_FREE;
+    }
+
+  qsort(events, 2 * (size_t) count, sizeof(event_t), compareEvents);
+
+  // the trace, in the format the driver replays
+  ktrace_hdr_t hdr;
+  ktrace_t trace = { &hdr, malloc(2 * (size_t) count * sizeof(ktrace_rec_t)), 0 };
+  unsigned long long inUse = 0;
+
+  if (trace.recs == NULL)
+    {
+      error("out of memory for requests", argv[optind]);
+    }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, KTRACE_MAGIC, sizeof(hdr.magic));
+  hdr.version = KTRACE_VERSION;
+  hdr.n_req = 2 * count;
+  hdr.n_ops = 2 * count;
+
+  for (i = 0; i < 2 * count; i++)
+    {
+      ktrace_rec_t* rec = &trace.recs[i];
+
+      rec->op = events[i].op;
+      rec->id = events[i].id;
+      rec->size = sizes[rec->id];
+
+      if (rec->op == KTRACE_REQUEST)
+	{
+	  inUse += rec->size;
+	  hdr.n_alloc++;
+	  hdr.total_bytes += rec->size;
+	  if (rec->size > hdr.max_size)
+	    {
+	      hdr.max_size = rec->size;
+	    }
+	  if (inUse > hdr.peak_bytes)
+	    {
+	      hdr.peak_bytes = inUse;
+	    }
+	}
+      else
+	{
+	  inUse -= rec->size;
+	  hdr.n_free++;
+	}
+    }
+
+  free(events);
+  free(sizes);
+
+  if (binary)
+    {
+      if (!ktrace_write(&trace, argv[optind + 5]))
+	{
+	  error("unable to write trace file", argv[optind + 5]);
+	}
+    }
+  else
+    {
+      FILE* file = fopen(argv[optind + 5], "w");
+      if (file == NULL)
+	{
+	  error("unable to write trace file", argv[optind + 5]);
+	}
+
+      fprintf(file, "%u\n", hdr.n_ops);
+      for (i = 0; i < 2 * count; i++)
+	{
+	  ktrace_rec_t* rec = &trace.recs[i];
+	  if (rec->op == KTRACE_REQUEST)
+	    {
+	      fprintf(file, "REQUEST %u %u\n", rec->id, rec->size);
+	    }
+	  else
+	    {
+	      fprintf(file, "FREE %u\n", rec->id);
+	    }
+	}
+
+      if (fclose(file) != 0)
+	{
+	  error("unable to write trace file", argv[optind + 5]);
+	}
+    }
+
+  printf("%u allocations, %u deallocations\n", hdr.n_alloc, hdr.n_free);
+  printf("Maximum bytes allocated: %llu\n", hdr.peak_bytes);
+  printf("Seed: %llu\n", seed);
+
+  free(trace.recs);
+  free(gBins);
+  return 0;
+}
+
+// uniform in [0, 1), xorshift64*
+double
+uniform()
+{
+  gState ^= gState >> 12;
+  gState ^= gState << 25;
+  gState ^= gState >> 27;
+  return ((gState * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+int
+drawSize(int model, int minSize, int maxSize)
+{
+  double value;
+
+  if (model == SIZE_HIST)
+    {
+      // binary search for the first bin past a uniform pick
+      double pick = uniform() * gBins[gNumBins - 1].weight;
+      int low = 0, high = gNumBins - 1;
+
+      while (low < high)
+	{
+	  int mid = (low + high) / 2;
+	  if (gBins[mid].weight > pick)
+	    {
+	      high = mid;
+	    }
+	  else
+	    {
+	      low = mid + 1;
+	    }
+	}
+
+      value = gBins[low].size;
+      return value < minSize ? minSize : value > maxSize ? maxSize : value;
+    }
+
+  if (model == SIZE_LOG)
+    {
+      value = pow(2.0, log2(minSize)
+		  + uniform() * (log2(maxSize) - log2(minSize)));
+    }
+  else
+    {
+      value = minSize + uniform() * (maxSize - minSize);
+    }
+
+  return (int) floor(value);
+}
+
+double
+drawFree(int model, int request, int count, int param, double longLived)
+{
+  double left = count - request;
+  int phase;
+
+  switch (model)
+    {
+    case LIFE_EARLY:
+      // 90% of the buffers are freed within the next 10% of the trace
+      if (uniform() < 0.9)
+	{
+	  return request + uniform() * 0.1 * left;
+	}
+      return request + uniform() * left;
+
+    case LIFE_BURST:
+      // the buffers of a phase of param requests are freed during the
+      // last quarter of the next phase
+      phase = request / param + 1;
+      return (phase + 0.75 + uniform() * 0.25) * param;
+
+    case LIFE_FIFO:
+      // the consumer trails the producer by param requests, a little
+      // jitter keeps the order but not the exact distance
+      return request + param + uniform() * 0.5;
+
+    case LIFE_MIXED:
+      if (uniform() < longLived)
+	{
+	  return count + uniform();
+	}
+      // exponential lifetime with mean param
+      return request + -log(1.0 - uniform()) * param;
+
+    case LIFE_UNIFORM:
+    default:
+      return request + uniform() * left;
+    }
+}
+
+void
+readHistogram(char* path)
+{
+  FILE* file = fopen(path, "r");
+  char line[256];
+  int size, capacity = 0;
+  double weight, total = 0.0;
+
+  if (file == NULL)
+    {
+      error("unable to open size histogram", path);
+    }
+
+  while (fgets(line, sizeof(line), file) != NULL)
+    {
+      if (line[0] == '#' || sscanf(line, "%d %lf", &size, &weight) != 2)
+	{
+	  continue;
+	}
+      if (size <= 0 || weight < 0.0)
+	{
+	  error("invalid size histogram line", line);
+	}
+
+      if (gNumBins == capacity)
+	{
+	  capacity = capacity ? 2 * capacity : 64;
+	  gBins = realloc(gBins, capacity * sizeof(bin_t));
+	  assert(gBins != NULL);
+	}
+
+      total += weight;
+      gBins[gNumBins].size = size;
+      gBins[gNumBins].weight = total;
+      gNumBins++;
+    }
+  fclose(file);
+
+  if (gNumBins == 0 || total <= 0.0)
+    {
+      error("empty size histogram", path);
+    }
+}
+
+// by time, a request before a free at the same time
+int
+compareEvents(const void* lhs, const void* rhs)
+{
+  const event_t* a = lhs;
+  const event_t* b = rhs;
+
+  if (a->time != b->time)
+    {
+      return a->time < b->time ? -1 : 1;
+    }
+  return (int) a->op - (int) b->op;
+}
+
+void
+usage()
+{
+  printf("Usage: %s [-b] [-s seed] [-p param] [-l longLivedFraction] "
+	 "allocation_count {log|linear|hist=file} min_request_size "
+	 "max_request_size {uniform|early|burst|fifo|mixed} out_file\n", name);
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}